@@ -0,0 +1,175 @@
+#!/usr/bin/env bash
+# Synthetic benchmark, runs magic-mount in an unprivileged mount namespace
+# (unshare -Urm) and prints one JSON object per run to stdout or -o FILE.
+# With -L it measures lookups on the mounted tree instead, against kernel
+# overlayfs and a flat copy of the same layers.
+
+set -euo pipefail
+
+usage() {
+    cat << EOF
+usage: $0 [OPTION]...
+
+-b BIN        magic-mount binary, default native/libs/<arch>/magic-mount
+-f N[,N...]   files per layer, a list gives a scaling curve, default 2000
+-d DEPTH      folder depth, default 3
+-w FANOUT     sub folders per folder, default 4
+-l LAYERS     number of layers, default 3
+-W PERCENT    entries of upper layers turned into whiteouts, default 5
+-O PERCENT    upper folders marked opaque, needs real root, default 0
+-s PERCENT    files created as symlinks, default 10
+-r RUNS       runs per configuration, default 3, timed passes with -L
+-L            time stat, open, readdir and exec lookups on the tree mounted by
+              magic-mount, by overlayfs and copied flat, needs cc
+-x OPTS       extra magic-mount options, e.g. "-a" or "-u"
+-o FILE       append results to FILE
+-k DIR        keep the generated layers in DIR
+EOF
+    exit 1
+}
+
+cd "$(dirname "$0")"
+
+bin="native/libs/$(uname -m | sed 's/aarch64/arm64-v8a/')/magic-mount"
+files=2000 depth=3 fanout=4 layers=3 whiteout=5 opaque=0 symlink=10 runs=3
+extra= out=/dev/stdout keep= lookup=
+while getopts "b:f:d:w:l:W:O:s:r:x:o:k:Lh" opt; do
+    case $opt in
+        b) bin=$OPTARG ;;
+        f) files=$OPTARG ;;
+        d) depth=$OPTARG ;;
+        w) fanout=$OPTARG ;;
+        l) layers=$OPTARG ;;
+        W) whiteout=$OPTARG ;;
+        O) opaque=$OPTARG ;;
+        s) symlink=$OPTARG ;;
+        r) runs=$OPTARG ;;
+        x) extra=$OPTARG ;;
+        o) out=$OPTARG ;;
+        k) keep=$OPTARG ;;
+        L) lookup=1 ;;
+        *) usage ;;
+    esac
+done
+
+[ -x "$bin" ] || { echo "no binary at $bin, see -b" >&2; exit 1; }
+bin="$(realpath "$bin")"
+version="$(git describe --always --dirty 2>/dev/null || echo unknown)"
+# binaries with -s report their own phase timings and counters
+has_stats=
+grep -q -- '^-s ' <<< "$("$bin" 2>&1 || true)" && has_stats=1
+if [ "$opaque" -gt 0 ] && [ "$(id -u)" != 0 ]; then
+    echo "opaque folders need trusted.* xattrs, run as root or use -O 0" >&2
+    exit 1
+fi
+
+work="${keep:-$(mktemp -d)}"
+[ -n "$keep" ] || trap 'rm -rf "$work"' EXIT
+probe="$work/bench_lookup"
+[ -z "$lookup" ] || "${CC:-cc}" -O2 -o "$probe" bench_lookup.c
+
+# folders of a FANOUT-ary tree of DEPTH levels, the same in every layer
+dirs=(.)
+level=(.)
+for ((d = 0; d < depth; d++)); do
+    next=()
+    for p in "${level[@]}"; do
+        for ((w = 0; w < fanout; w++)); do
+            next+=("$p/d$w")
+        done
+    done
+    dirs+=("${next[@]}")
+    level=("${next[@]}")
+done
+
+# layer 1 is the top, every layer holds about two thirds of the files so
+# names overlap between layers and folders get merged
+generate() {
+    local n=$1 root=$2
+    RANDOM=$n
+    rm -rf "$root"
+    for ((l = 1; l <= layers; l++)); do
+        local layer="$root/l$l"
+        for p in "${dirs[@]}"; do
+            mkdir -p "$layer/$p"
+            if [ "$p" != . ] && ((l < layers && RANDOM % 100 < opaque)); then
+                setfattr -n trusted.overlay.opaque -v y "$layer/$p"
+            fi
+        done
+        for ((i = 0; i < n; i++)); do
+            ((i % 3 != l % 3)) || continue
+            local f="$layer/${dirs[i % ${#dirs[@]}]}/f$i"
+            if ((l < layers && RANDOM % 100 < whiteout)); then
+                mknod "$f" c 0 0
+            elif ((RANDOM % 100 < symlink)); then
+                ln -s "f$i.target" "$f"
+            else
+                : > "$f"
+            fi
+        done
+    done
+    mkdir -p "$root/target"
+}
+
+run() {
+    local n=$1 root=$2 args=()
+    rm -f "$root/stats.json"
+    [ -z "$has_stats" ] || args+=(-s "$root/stats.json")
+    for ((l = 1; l <= layers; l++)); do
+        args+=("$root/l$l")
+    done
+    args+=("$root/target")
+    unshare -Urm sh -c '
+        start=$(date +%s%N)
+        "$@" >/dev/null 2>&1; rc=$?
+        end=$(date +%s%N)
+        echo "$rc $(( (end - start) / 1000 )) $(grep -c " $0" /proc/self/mountinfo)"
+    ' "$root/target" "$bin" $extra "${args[@]}"
+}
+
+# the same layers mounted by magic-mount, by overlayfs and copied flat, one
+# "TREE OP COUNT OPS_PER_S P50_NS P99_NS P999_NS MAX_NS" line per lookup
+# operation of bench_lookup.c on each
+lookups() {
+    local root=$1 args=() lowers=
+    for ((l = 1; l <= layers; l++)); do
+        args+=("$root/l$l")
+        lowers+="${lowers:+:}$root/l$l"
+    done
+    args+=("$root/target")
+    rm -rf "$root/overlay" "$root/flat"
+    mkdir -p "$root/overlay" "$root/flat"
+    unshare -Urm sh -c '
+        probe=$1 runs=$2 root=$3 lowers=$4; shift 4
+        "$@" >/dev/null 2>&1 || exit 1
+        cp -a "$root/target/." "$root/flat/"
+        (cd "$root/target" && find . -mindepth 1 \( -type d -printf "d %P\n" \) -o -printf "f %P\n") > "$root/paths"
+        "$probe" "$root/target" "$root/paths" "$runs" | sed "s/^/magic-mount /"
+        if mount -t overlay overlay -o "lowerdir=$lowers" "$root/overlay"; then
+            "$probe" "$root/overlay" "$root/paths" "$runs" | sed "s/^/overlayfs /"
+        fi
+        "$probe" "$root/flat" "$root/paths" "$runs" | sed "s/^/flat /"
+    ' sh "$probe" "$runs" "$root" "$lowers" "$bin" $extra "${args[@]}"
+}
+
+IFS=, read -ra counts <<< "$files"
+for n in "${counts[@]}"; do
+    root="$work/f$n"
+    generate "$n" "$root"
+    entries=$(find "$root" -mindepth 2 | wc -l)
+    if [ -n "$lookup" ]; then
+        lookups "$root" | while read -r tree op count ops p50 p99 p999 max; do
+            printf '{"version":"%s","files":%d,"depth":%d,"fanout":%d,"layers":%d,"whiteout":%d,"opaque":%d,"symlink":%d,"options":"%s","entries":%d,"tree":"%s","op":"%s","count":%d,"ops_per_s":%d,"p50_ns":%d,"p99_ns":%d,"p999_ns":%d,"max_ns":%d}\n' \
+                "$version" "$n" "$depth" "$fanout" "$layers" "$whiteout" "$opaque" "$symlink" "$extra" \
+                "$entries" "$tree" "$op" "$count" "$ops" "$p50" "$p99" "$p999" "$max" >> "$out"
+        done
+        continue
+    fi
+    for ((r = 1; r <= runs; r++)); do
+        read -r rc wall_us mounts <<< "$(run "$n" "$root")"
+        stats="$(cat "$root/stats.json" 2>/dev/null || echo null)"
+        printf '{"version":"%s","files":%d,"depth":%d,"fanout":%d,"layers":%d,"whiteout":%d,"opaque":%d,"symlink":%d,"options":"%s","run":%d,"entries":%d,"rc":%d,"wall_us":%d,"mounts":%d,"stats":%s}\n' \
+            "$version" "$n" "$depth" "$fanout" "$layers" "$whiteout" "$opaque" "$symlink" "$extra" "$r" \
+            "$entries" "$rc" "$wall_us" "$mounts" "$stats" >> "$out"
+    done
+done
@@ -0,0 +1,150 @@
+// Lookup probe of bench.sh -L, times path lookups under a mounted tree.
+//
+// usage: bench_lookup ROOT LIST PASSES
+//
+// LIST holds one "d PATH" or "f PATH" line per entry, PATH relative to ROOT.
+// After one warm-up pass, every operation runs PASSES times over all entries
+// in a shuffled order and one line per operation is printed:
+//
+//   OP COUNT OPS_PER_S P50_NS P99_NS P999_NS MAX_NS
+//
+// stat is lstat of every entry, open an open and close of every file, readdir
+// a full read of every folder and exec the access(X_OK) lookup execve does on
+// every file.
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+struct list {
+    char **paths;
+    size_t count;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void add(struct list *l, const char *root, const char *path)
+{
+    l->paths = realloc(l->paths, (l->count + 1) * sizeof(char *));
+    if (asprintf(&l->paths[l->count], "%s/%s", root, path) < 0)
+        exit(1);
+    l->count++;
+}
+
+static uint64_t rng = 88172645463325252ULL;
+
+static void shuffle(struct list *l)
+{
+    for (size_t i = l->count; i > 1; i--) {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        size_t j = rng % i;
+        char *t = l->paths[i - 1];
+        l->paths[i - 1] = l->paths[j];
+        l->paths[j] = t;
+    }
+}
+
+static void op_stat(const char *path)
+{
+    struct stat st;
+    lstat(path, &st);
+}
+
+static void op_open(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+        close(fd);
+}
+
+static void op_readdir(const char *path)
+{
+    DIR *d = opendir(path);
+    if (d == NULL)
+        return;
+    while (readdir(d) != NULL)
+        ;
+    closedir(d);
+}
+
+static void op_exec(const char *path)
+{
+    access(path, X_OK);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void run(const char *name, void (*op)(const char *), struct list *l, int passes)
+{
+    if (l->count == 0)
+        return;
+    for (size_t i = 0; i < l->count; i++)
+        op(l->paths[i]);
+    size_t n = l->count * passes;
+    uint64_t *lat = malloc(n * sizeof(uint64_t));
+    uint64_t total = 0;
+    size_t k = 0;
+    for (int p = 0; p < passes; p++) {
+        shuffle(l);
+        for (size_t i = 0; i < l->count; i++) {
+            uint64_t start = now_ns();
+            op(l->paths[i]);
+            lat[k] = now_ns() - start;
+            total += lat[k++];
+        }
+    }
+    qsort(lat, n, sizeof(uint64_t), cmp_u64);
+    printf("%s %zu %.0f %llu %llu %llu %llu\n", name, n, total? n * 1e9 / total : 0.0,
+           (unsigned long long) lat[n / 2], (unsigned long long) lat[n * 99 / 100],
+           (unsigned long long) lat[n * 999 / 1000], (unsigned long long) lat[n - 1]);
+    free(lat);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s ROOT LIST PASSES\n", argv[0]);
+        return 1;
+    }
+    FILE *fp = fopen(argv[2], "r");
+    if (fp == NULL) {
+        perror(argv[2]);
+        return 1;
+    }
+    struct list all = {0}, files = {0}, dirs = {0};
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, fp)) > 2) {
+        if (line[len - 1] == '\n')
+            line[len - 1] = '\0';
+        add(&all, argv[1], line + 2);
+        add(line[0] == 'd'? &dirs : &files, argv[1], line + 2);
+    }
+    free(line);
+    fclose(fp);
+    int passes = atoi(argv[3]) > 0? atoi(argv[3]) : 1;
+    run("stat", op_stat, &all, passes);
+    run("open", op_open, &files, passes);
+    run("readdir", op_readdir, &dirs, passes);
+    run("exec", op_exec, &files, passes);
+    return 0;
+}
@@ -3,6 +3,11 @@
 set -euo pipefail
 
 build_mode="${1:-release}"
+# debug records are compiled out of release builds
+cflags=
+if [ "$build_mode" = release ]; then
+    cflags=-DLOG_MIN_LEVEL=LOG_LEVEL_INFO
+fi
 
 cd "$(dirname "$0")"
 
@@ -25,9 +30,10 @@ EOF
         mkdir "native/libs/${ARCH}"
         ${CXX} \
     native/jni/main.cpp \
-    native/jni/logging.cpp native/jni/utils.cpp \
+    native/jni/logging.cpp native/jni/utils.cpp native/jni/mount_api.cpp native/jni/thread_pool.cpp native/jni/plan.cpp native/jni/io_batch.cpp native/jni/stats.cpp native/jni/arena.cpp native/jni/dedupe.cpp native/jni/provenance.cpp \
     -static \
     -std=c++17 \
+    ${cflags} \
     -o "native/libs/${ARCH}/magic-mount"
     fi
 done
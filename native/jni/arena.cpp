@@ -0,0 +1,43 @@
+#include "arena.hpp"
+
+#define ARENA_CHUNK (64 * 1024)
+
+void *arena_alloc(size_t size, size_t align) {
+    static thread_local char *cur = nullptr;
+    static thread_local char *end = nullptr;
+    if (size > ARENA_CHUNK / 4)
+        return aligned_alloc(align, (size + align - 1) / align * align);
+    char *p = (char *) (((uintptr_t) cur + align - 1) & ~(uintptr_t) (align - 1));
+    if (cur == nullptr || p + size > end) {
+        cur = (char *) malloc(ARENA_CHUNK);
+        if (cur == nullptr)
+            throw std::bad_alloc();
+        end = cur + ARENA_CHUNK;
+        p = cur;
+    }
+    cur = p + size;
+    return p;
+}
+
+// names are spread over shards by hash so scanning threads rarely wait
+#define NAME_SHARDS 16
+
+struct name_shard {
+    std::mutex lock;
+    std::unordered_set<std::string_view> names;
+};
+
+const char *intern_name(std::string_view name) {
+    static name_shard shards[NAME_SHARDS];
+    size_t h = std::hash<std::string_view>()(name);
+    name_shard &s = shards[h % NAME_SHARDS];
+    std::lock_guard<std::mutex> lk(s.lock);
+    auto it = s.names.find(name);
+    if (it != s.names.end())
+        return it->data();
+    char *copy = (char *) arena_alloc(name.size() + 1, 1);
+    memcpy(copy, name.data(), name.size());
+    copy[name.size()] = '\0';
+    s.names.insert(std::string_view(copy, name.size()));
+    return copy;
+}
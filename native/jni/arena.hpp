@@ -0,0 +1,42 @@
+#pragma once
+#include "base.hpp"
+#include <new>
+
+// bump allocator for the merged trees, nothing is freed before exit. Every
+// thread carves its allocations from chunks of its own.
+void *arena_alloc(size_t size, size_t align);
+
+template <typename T>
+T *arena_new()
+{
+    return new (arena_alloc(sizeof(T), alignof(T))) T();
+}
+
+// fixed array in the arena
+template <typename T>
+struct arena_span
+{
+    T *data = nullptr;
+    uint32_t count = 0;
+
+    T *begin() const { return data; }
+    T *end() const { return data + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    T &operator[](size_t i) const { return data[i]; }
+};
+
+template <typename T>
+arena_span<T> arena_copy(const T *src, size_t n)
+{
+    arena_span<T> span;
+    if (n == 0)
+        return span;
+    span.data = (T *) arena_alloc(n * sizeof(T), alignof(T));
+    span.count = n;
+    std::copy(src, src + n, span.data);
+    return span;
+}
+
+// the copy of name in the arena shared by every equal name
+const char *intern_name(std::string_view name);
@@ -5,6 +5,11 @@
 #include <iostream>
 #include <sys/mman.h>
 #include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string_view>
@@ -20,3 +25,7 @@
 #include <string_view>
 #include <sys/xattr.h>
 #include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <utility>
@@ -0,0 +1,111 @@
+#include <sys/ioctl.h>
+
+#include "dedupe.hpp"
+#include "utils.hpp"
+#include "stats.hpp"
+
+#ifndef FS_IOC_MEASURE_VERITY
+struct fsverity_digest {
+    uint16_t digest_algorithm;
+    uint16_t digest_size;
+    uint8_t digest[];
+};
+#define FS_IOC_MEASURE_VERITY _IOWR('f', 134, struct fsverity_digest)
+#endif
+#define VERITY_MAX_DIGEST 64
+
+// algorithm and digest of a file with fs-verity enabled
+static bool verity_digest(int fd, std::string &digest)
+{
+    alignas(fsverity_digest) char buf[sizeof(fsverity_digest) + VERITY_MAX_DIGEST];
+    auto d = (fsverity_digest *) buf;
+    d->digest_size = VERITY_MAX_DIGEST;
+    STAT_INC(syscalls);
+    if (ioctl(fd, FS_IOC_MEASURE_VERITY, d))
+        return false;
+    digest.assign((const char *) &d->digest_algorithm, sizeof(d->digest_algorithm));
+    digest.append((const char *) d->digest, d->digest_size);
+    return true;
+}
+
+// result of one comparison of two inodes, valid while neither changes
+struct compare_entry {
+    struct timespec mtime_a, ctime_a, mtime_b, ctime_b;
+    bool same;
+};
+
+static std::mutex compare_lock;
+static std::map<std::pair<std::pair<dev_t, ino_t>, std::pair<dev_t, ino_t>>, compare_entry> compare_cache;
+
+static bool same_time(const struct timespec &a, const struct timespec &b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// read len bytes of fd at off, false if the file ends first
+static bool read_at(int fd, char *buf, size_t len, off_t off)
+{
+    while (len > 0) {
+        STAT_INC(syscalls);
+        ssize_t n = pread(fd, buf, len, off);
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return true;
+}
+
+// whether the first size bytes of fd_a and fd_b are the same
+static bool same_data(int fd_a, int fd_b, off_t size)
+{
+    const size_t chunk = 64 * 1024;
+    std::vector<char> buf_a(chunk), buf_b(chunk);
+    for (off_t off = 0; off < size;) {
+        size_t len = std::min((off_t) chunk, size - off);
+        if (!read_at(fd_a, buf_a.data(), len, off) || !read_at(fd_b, buf_b.data(), len, off) ||
+            memcmp(buf_a.data(), buf_b.data(), len) != 0)
+            return false;
+        off += len;
+    }
+    return true;
+}
+
+// same_data of a and b, from the cache while both inodes are unchanged. A
+// file that changed while it was read counts as different and is not cached.
+static bool same_content(int fd_a, const struct stat &a, int fd_b, const struct stat &b)
+{
+    auto key = std::make_pair(std::make_pair(a.st_dev, a.st_ino), std::make_pair(b.st_dev, b.st_ino));
+    {
+        std::lock_guard<std::mutex> lk(compare_lock);
+        auto it = compare_cache.find(key);
+        if (it != compare_cache.end() &&
+            same_time(it->second.mtime_a, a.st_mtim) && same_time(it->second.ctime_a, a.st_ctim) &&
+            same_time(it->second.mtime_b, b.st_mtim) && same_time(it->second.ctime_b, b.st_ctim))
+            return it->second.same;
+    }
+    bool same = same_data(fd_a, fd_b, a.st_size);
+    struct stat now_a, now_b;
+    STAT_ADD(syscalls, 2);
+    if (fstat(fd_a, &now_a) || fstat(fd_b, &now_b) || now_a.st_size != a.st_size || now_b.st_size != b.st_size ||
+        !same_time(now_a.st_mtim, a.st_mtim) || !same_time(now_a.st_ctim, a.st_ctim) ||
+        !same_time(now_b.st_mtim, b.st_mtim) || !same_time(now_b.st_ctim, b.st_ctim))
+        return false;
+    std::lock_guard<std::mutex> lk(compare_lock);
+    compare_cache[key] = { a.st_mtim, a.st_ctim, b.st_mtim, b.st_ctim, same };
+    return same;
+}
+
+bool same_file(int fd_a, const struct stat &a, const char *con_a,
+               int fd_b, const struct stat &b, const char *con_b) {
+    if (a.st_dev == b.st_dev && a.st_ino == b.st_ino)
+        return true;
+    if (a.st_mode != b.st_mode || a.st_uid != b.st_uid || a.st_gid != b.st_gid ||
+        a.st_size != b.st_size || con_a != con_b)
+        return false;
+    std::string va, vb;
+    if (verity_digest(fd_a, va) && verity_digest(fd_b, vb))
+        return va == vb;
+    return same_content(fd_a, a, fd_b, b);
+}
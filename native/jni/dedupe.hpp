@@ -0,0 +1,10 @@
+#pragma once
+#include "base.hpp"
+
+// whether the regular files open in fd_a and fd_b, with attributes from
+// fstat and interned contexts, are interchangeable: the same inode, or the
+// same mode, owner, context and content. Content is compared by fs-verity
+// digest where both files have one, else byte by byte, and the result is
+// cached per pair of inodes for the run.
+bool same_file(int fd_a, const struct stat &a, const char *con_a,
+               int fd_b, const struct stat &b, const char *con_b);
@@ -0,0 +1,236 @@
+#include "io_batch.hpp"
+#include "stats.hpp"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <atomic>
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+
+#define RING_ENTRIES 256
+
+static std::atomic<bool> uring_enabled{false};
+// opcodes the running kernel implements, filled once by enable()
+static bool op_supported[256];
+
+// submission and completion rings of one thread
+struct ring {
+    int fd = -1;
+    unsigned entries = 0;
+    void *sq_ptr = MAP_FAILED;
+    void *cq_ptr = MAP_FAILED;
+    size_t sq_size = 0, cq_size = 0;
+    struct io_uring_sqe *sqes = (struct io_uring_sqe *) MAP_FAILED;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    bool setup() {
+        struct io_uring_params p{};
+        fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+        if (fd < 0)
+            return false;
+        entries = p.sq_entries;
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED)
+            return false;
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ptr = sq_ptr;
+        } else {
+            cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED)
+                return false;
+        }
+        sqes = (struct io_uring_sqe *) mmap(nullptr, entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return false;
+        char *sq = (char *) sq_ptr, *cq = (char *) cq_ptr;
+        sq_tail = (unsigned *) (sq + p.sq_off.tail);
+        sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+        sq_array = (unsigned *) (sq + p.sq_off.array);
+        cq_head = (unsigned *) (cq + p.cq_off.head);
+        cq_tail = (unsigned *) (cq + p.cq_off.tail);
+        cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+        return true;
+    }
+
+    void destroy() {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, entries * sizeof(struct io_uring_sqe));
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_size);
+        if (sq_ptr != MAP_FAILED)
+            munmap(sq_ptr, sq_size);
+        if (fd >= 0)
+            close(fd);
+        sqes = (struct io_uring_sqe *) MAP_FAILED;
+        sq_ptr = cq_ptr = MAP_FAILED;
+        fd = -1;
+    }
+
+    ~ring() { destroy(); }
+};
+
+// ring of the calling thread, nullptr if it could not be set up
+static ring *thread_ring() {
+    static thread_local ring r;
+    static thread_local bool failed = false;
+    if (r.fd < 0 && !failed && !r.setup()) {
+        r.destroy();
+        failed = true;
+    }
+    return failed? nullptr : &r;
+}
+
+bool io_batch::enable() {
+    ring *r = thread_ring();
+    if (r == nullptr)
+        return false;
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    std::vector<char> buf(len);
+    auto *probe = (struct io_uring_probe *) buf.data();
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, 256))
+        return false;
+    for (int i = 0; i < probe->ops_len; i++)
+        op_supported[probe->ops[i].op] = probe->ops[i].flags & IO_URING_OP_SUPPORTED;
+    uring_enabled = true;
+    return true;
+}
+
+bool io_batch::enabled() {
+    return uring_enabled;
+}
+
+void io_batch::statx(int dirfd, const char *name, int flags, unsigned mask, struct statx *buf, int *res) {
+    ops.push_back({ IORING_OP_STATX, dirfd, name, nullptr, flags, mask, buf, res });
+}
+
+void io_batch::openat(int dirfd, const char *name, int flags, mode_t mode, int *res) {
+    ops.push_back({ IORING_OP_OPENAT, dirfd, name, nullptr, flags, mode, nullptr, res });
+}
+
+void io_batch::mkdirat(int dirfd, const char *name, mode_t mode, int *res) {
+    ops.push_back({ IORING_OP_MKDIRAT, dirfd, name, nullptr, 0, mode, nullptr, res });
+}
+
+void io_batch::symlinkat(const char *target, int dirfd, const char *name, int *res) {
+    ops.push_back({ IORING_OP_SYMLINKAT, dirfd, name, target, 0, 0, nullptr, res });
+}
+
+static int run_sync(uint8_t opcode, int dirfd, const char *name, const char *target, int flags, unsigned mode, void *buf) {
+    int ret = -1;
+    STAT_INC(syscalls);
+    switch (opcode) {
+    case IORING_OP_STATX:
+        ret = ::statx(dirfd, name, flags, mode, (struct statx *) buf);
+        break;
+    case IORING_OP_OPENAT:
+        ret = ::openat(dirfd, name, flags, mode);
+        break;
+    case IORING_OP_MKDIRAT:
+        ret = ::mkdirat(dirfd, name, mode);
+        break;
+    case IORING_OP_SYMLINKAT:
+        ret = ::symlinkat(target, dirfd, name);
+        break;
+    }
+    return ret < 0? -errno : ret;
+}
+
+static void prep_sqe(struct io_uring_sqe *sqe, uint8_t opcode, int dirfd, const char *name, const char *target,
+                     int flags, unsigned mode, void *buf) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = dirfd;
+    sqe->len = mode;
+    switch (opcode) {
+    case IORING_OP_STATX:
+        sqe->addr = (uintptr_t) name;
+        sqe->off = (uintptr_t) buf;
+        sqe->statx_flags = flags;
+        break;
+    case IORING_OP_OPENAT:
+        sqe->addr = (uintptr_t) name;
+        sqe->open_flags = flags;
+        break;
+    case IORING_OP_MKDIRAT:
+        sqe->addr = (uintptr_t) name;
+        break;
+    case IORING_OP_SYMLINKAT:
+        sqe->addr = (uintptr_t) target;
+        sqe->addr2 = (uintptr_t) name;
+        break;
+    }
+}
+
+void io_batch::submit() {
+    ring *r = uring_enabled? thread_ring() : nullptr;
+    size_t i = 0;
+    while (i < ops.size()) {
+        if (r == nullptr) {
+            for (; i < ops.size(); i++) {
+                op &o = ops[i];
+                *o.res = run_sync(o.opcode, o.dirfd, o.name, o.target, o.flags, o.mode, o.buf);
+            }
+            break;
+        }
+        // fill the ring, the previous round left it empty
+        unsigned tail = *r->sq_tail;
+        unsigned queued = 0;
+        for (; i < ops.size() && queued < r->entries; i++) {
+            op &o = ops[i];
+            if (!op_supported[o.opcode]) {
+                *o.res = run_sync(o.opcode, o.dirfd, o.name, o.target, o.flags, o.mode, o.buf);
+                continue;
+            }
+            unsigned idx = tail & *r->sq_mask;
+            prep_sqe(&r->sqes[idx], o.opcode, o.dirfd, o.name, o.target, o.flags, o.mode, o.buf);
+            r->sqes[idx].user_data = i;
+            *o.res = INT_MIN;
+            r->sq_array[idx] = idx;
+            tail++;
+            queued++;
+        }
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+        // submit everything and reap until every operation completed
+        unsigned submitted = 0, completed = 0;
+        while (completed < queued) {
+            int ret = syscall(__NR_io_uring_enter, r->fd, queued - submitted, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            STAT_INC(syscalls);
+            if (ret < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                    continue;
+                // the ring is unusable, operations still in it are lost with it
+                int err = errno;
+                for (size_t j = 0; j < i; j++)
+                    if (*ops[j].res == INT_MIN)
+                        *ops[j].res = -err;
+                r->destroy();
+                r = nullptr;
+                break;
+            }
+            submitted += ret;
+            unsigned head = *r->cq_head;
+            unsigned ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != ctail; head++, completed++) {
+                auto &cqe = r->cqes[head & *r->cq_mask];
+                *ops[cqe.user_data].res = cqe.res;
+            }
+            __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+    ops.clear();
+}
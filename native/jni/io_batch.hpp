@@ -0,0 +1,36 @@
+#pragma once
+#include "base.hpp"
+
+// A batch of independent file system operations. Once io_uring is enabled,
+// a batch is submitted with one io_uring_enter(2) per ring full of entries,
+// otherwise (or for operations the kernel has no opcode for) each operation
+// runs synchronously in submit(). Every result is stored to its int as the
+// syscall would return it, with -errno on failure. Operations of a batch must
+// not depend on each other, names and buffers must outlive submit().
+class io_batch {
+public:
+    // use io_uring for the batches of every thread, false if it is unusable
+    static bool enable();
+    static bool enabled();
+
+    void statx(int dirfd, const char *name, int flags, unsigned mask, struct statx *buf, int *res);
+    void openat(int dirfd, const char *name, int flags, mode_t mode, int *res);
+    void mkdirat(int dirfd, const char *name, mode_t mode, int *res);
+    void symlinkat(const char *target, int dirfd, const char *name, int *res);
+    // run all queued operations and clear the batch
+    void submit();
+    bool empty() const { return ops.empty(); }
+
+private:
+    struct op {
+        uint8_t opcode;
+        int dirfd;
+        const char *name;
+        const char *target;
+        int flags;
+        unsigned mode;
+        void *buf;
+        int *res;
+    };
+    std::vector<op> ops;
+};
@@ -1,10 +1,53 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/uio.h>
 #include <sys/time.h>
 #include <time.h>
 #include <string>
+#include <algorithm>
+#include <mutex>
 #include <unistd.h>
 
+// records wait in a ring until it runs full or log_flush(), which
+// writes them out with a single writev
+#define LOG_RING_SIZE (64 * 1024)
+
+static std::mutex ring_lock;
+static char ring[LOG_RING_SIZE];
+static size_t ring_head = 0; // next byte to fill
+static size_t ring_used = 0;
+static int ring_fd = -1;
+
+static void flush_locked() {
+    if (ring_used == 0)
+        return;
+    size_t tail = (ring_head + LOG_RING_SIZE - ring_used) % LOG_RING_SIZE;
+    struct iovec iov[2];
+    int cnt = 0;
+    if (tail + ring_used <= LOG_RING_SIZE) {
+        iov[cnt++] = { ring + tail, ring_used };
+    } else {
+        iov[cnt++] = { ring + tail, LOG_RING_SIZE - tail };
+        iov[cnt++] = { ring, ring_used - (LOG_RING_SIZE - tail) };
+    }
+    writev(ring_fd, iov, cnt);
+    ring_used = 0;
+}
+
+static void append_locked(const char *s, size_t len) {
+    size_t first = std::min(len, LOG_RING_SIZE - ring_head);
+    memcpy(ring + ring_head, s, first);
+    memcpy(ring, s + first, len - first);
+    ring_head = (ring_head + len) % LOG_RING_SIZE;
+    ring_used += len;
+}
+
+void log_flush() {
+    std::lock_guard<std::mutex> lk(ring_lock);
+    flush_locked();
+}
+
 void log_to_file(int fd, int prio, const char *log) {
     if (fd < 0) {
         return;
@@ -30,15 +73,47 @@ void log_to_file(int fd, int prio, const char *log) {
             prio_c = 'I';
             break;
     }
-    char buf[4098];
-    // current date/time based on current system
+    // looked up per record, a forked child logs with its own ids
+    const int pid = getpid();
+    static thread_local int tid_pid = 0, tid = 0;
+    if (tid_pid != pid) {
+        tid = gettid();
+        tid_pid = pid;
+    }
+    // date and time are only broken down once per second
+    static time_t cached_sec = -1;
+    static char cached_date[32];
+    char head[64];
     timeval tv;
-    tm tm;
     gettimeofday(&tv, nullptr);
-    localtime_r(&tv.tv_sec, &tm);
     long ms = tv.tv_usec / 1000;
-    size_t off = strftime(buf, sizeof(buf), "%m-%d %T", &tm);
-    snprintf(buf + off, sizeof(buf) - off,
-        ".%03ld %5d %5d %c : %s", ms, getpid(), gettid(), prio_c, log);
-    write(fd, buf, strlen(buf));
+    size_t len = strlen(log);
+
+    std::lock_guard<std::mutex> lk(ring_lock);
+    if (tv.tv_sec != cached_sec) {
+        tm tm;
+        localtime_r(&tv.tv_sec, &tm);
+        strftime(cached_date, sizeof(cached_date), "%m-%d %T", &tm);
+        cached_sec = tv.tv_sec;
+    }
+    size_t head_len = snprintf(head, sizeof(head), "%s.%03ld %5d %5d %c : ", cached_date, ms, pid, tid, prio_c);
+    if (ring_fd != fd) {
+        flush_locked();
+        ring_fd = fd;
+    }
+    if (ring_used == 0) {
+        static bool registered = false;
+        if (!registered)
+            registered = atexit(log_flush) == 0;
+    }
+    if (ring_used + head_len + len > LOG_RING_SIZE)
+        flush_locked();
+    if (head_len + len > LOG_RING_SIZE) {
+        // too large to buffer
+        struct iovec iov[2] = { { head, head_len }, { (void *) log, len } };
+        writev(fd, iov, 2);
+        return;
+    }
+    append_locked(head, head_len);
+    append_locked(log, len);
 }
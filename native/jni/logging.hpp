@@ -2,19 +2,39 @@
 #include <errno.h>
 #define LOG_TAG "MagicMount"
 
+enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_NONE,
+};
+
+// records below this level are compiled out, release builds use LOG_LEVEL_INFO
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
 extern int log_fd;
+// records below this level are dropped before they are formatted,
+// LOG_LEVEL_NONE while there is nowhere to log to
+extern int log_level;
+
+#define LOG_ON(LEVEL) ((LEVEL) >= LOG_MIN_LEVEL && (LEVEL) >= log_level)
 
-#define write_log(PRIO, TAG, ...) \
-    { \
+#define write_log(PRIO, LEVEL, ...) \
+    if (LOG_ON(LEVEL) && log_fd >= 0) { \
       char logbuffer[4098]; \
       snprintf(logbuffer, sizeof(logbuffer)-1, __VA_ARGS__); \
       log_to_file(log_fd, PRIO, logbuffer); \
     }
 
-#define LOGD(...) write_log(1, LOG_TAG, __VA_ARGS__)
-#define LOGI(...) write_log(0, LOG_TAG, __VA_ARGS__)
-#define LOGW(...) write_log(2, LOG_TAG, __VA_ARGS__)
-#define LOGE(...) write_log(3, LOG_TAG, __VA_ARGS__)
+#define LOGD(...) { write_log(1, LOG_LEVEL_DEBUG, __VA_ARGS__) }
+#define LOGI(...) { write_log(0, LOG_LEVEL_INFO, __VA_ARGS__) }
+#define LOGW(...) { write_log(2, LOG_LEVEL_WARN, __VA_ARGS__) }
+#define LOGE(...) { write_log(3, LOG_LEVEL_ERROR, __VA_ARGS__) }
 #define PLOGE(fmt, args...) LOGE(fmt " failed with %d: %s\n", ##args, errno, std::strerror(errno))
 
 void log_to_file(int fd, int prio, const char *log);
+// write out buffered records, also done at exit
+void log_flush();
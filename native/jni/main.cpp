@@ -1,9 +1,18 @@
 #include <sys/xattr.h>
+#include <sys/wait.h>
 #include <errno.h>
 
 #include "logging.hpp"
 #include "base.hpp"
 #include "utils.hpp"
+#include "mount_api.hpp"
+#include "thread_pool.hpp"
+#include "node.hpp"
+#include "plan.hpp"
+#include "io_batch.hpp"
+#include "stats.hpp"
+#include "dedupe.hpp"
+#include "provenance.hpp"
 
 int log_fd = -1;
 static int mount_flags = 0;
@@ -11,238 +20,1938 @@ static bool verbose_logging = false;
 char **_argv;
 int _argc;
 bool full_magic_mount = false;
+// merged tree is built with the new mount api and attached at the end
+static bool detached_tree = false;
+// the root of the merged tree is a folder bound onto the tmpfs root
+static bool root_bound = false;
 
-#define verbose_log(s, ...) { \
+int log_level = LOG_LEVEL_DEBUG;
+
+#define log_at(LEVEL, LOG, s, ...) { \
+if (LOG_ON(LEVEL)) { \
 if (verbose_logging) fprintf(stdout, "%-12s: " s, __VA_ARGS__); \
-LOGD("%-12s: " s, __VA_ARGS__); }
+LOG("%-12s: " s, __VA_ARGS__); } }
+// per node details
+#define verbose_log(s, ...) log_at(LOG_LEVEL_DEBUG, LOGD, s, __VA_ARGS__)
+#define info_log(s, ...) log_at(LOG_LEVEL_INFO, LOGI, s, __VA_ARGS__)
+#define warn_log(s, ...) log_at(LOG_LEVEL_WARN, LOGW, s, __VA_ARGS__)
+#define error_log(s, ...) log_at(LOG_LEVEL_ERROR, LOGE, s, __VA_ARGS__)
+
+static bool is_supported_fs(struct statfs &st) {
+    switch (st.f_type) {
+        case PROC_SUPER_MAGIC:
+        case SELINUX_MAGIC:
+        case SYSFS_MAGIC:
+            return false;
+    }
+    return true;
+}
 
 static bool is_supported_fs(const char *dir) {
     struct statfs st;
-    if (statfs(dir, &st) == 0) {
-       switch (st.f_type) {
-           case PROC_SUPER_MAGIC:
-           case SELINUX_MAGIC:
-           case SYSFS_MAGIC:
-               return false;
-       }
-       return true;
-    }
-    return false;
+    return statfs(dir, &st) == 0 && is_supported_fs(st);
+}
+
+static bool is_supported_fs(int fd) {
+    struct statfs st;
+    return fstatfs(fd, &st) == 0 && is_supported_fs(st);
 }
 
-int clone_attr(const char *src, const char *dest) 
+// fields of a source entry used for merging and cloning attributes
+#define ATTR_MASK (STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID)
+
+// context a new node of type (S_IFMT) gets under a folder of context parent,
+// learnt from the first such node, nodes that would get the wanted one anyway
+// skip setting it
+static std::mutex default_con_lock;
+static std::map<std::pair<const char *, mode_t>, const char *> default_con;
+
+// umask is 0 while a tree is built, so nodes are created with their final
+// mode. Files written for the caller keep its umask.
+struct umask_scope
 {
-    struct stat st;
-    char *con;
-    if (stat(src, &st) || getfilecon(src, &con) == -1)
+    mode_t old = umask(0);
+
+    ~umask_scope() { umask(old); }
+};
+
+// set mode, owner and context cached from the source on fd. A node just
+// created with the right mode (see umask_scope) and owned by us only needs the
+// parts that differ.
+static int set_attr(int fd, mode_t mode, uid_t uid, gid_t gid, const char *con, bool created, const char *parent_con)
+{
+    static const uid_t euid = geteuid();
+    static const gid_t egid = getegid();
+    if (!created) {
+        STAT_INC(syscalls);
+        if (fchmod(fd, mode & 0777))
+            return -1;
+    }
+    if (!created || uid != euid || gid != egid) {
+        STAT_INC(syscalls);
+        if (fchownat(fd, "", uid, gid, AT_EMPTY_PATH))
+            return -1;
+    }
+    if (con == nullptr)
+        return 0;
+    if (created && parent_con) {
+        auto key = std::make_pair(parent_con, (mode_t) (mode & S_IFMT));
+        std::lock_guard<std::mutex> lk(default_con_lock);
+        auto it = default_con.find(key);
+        if (it == default_con.end()) {
+            const char *cur;
+            if (getcon_interned(fd, "", &cur) == 0)
+                it = default_con.emplace(key, cur).first;
+        }
+        if (it != default_con.end() && it->second == con)
+            return 0;
+    }
+    STAT_INC(syscalls);
+    STAT_INC(xattr_writes);
+    if (fsetxattr(fd, "security.selinux", con, strlen(con) + 1, 0) == 0)
+        return 0;
+    if (errno != EBADF)
         return -1;
-    bool ret = (chmod(dest, (st.st_mode & 0777)) ||
-        chown(dest, st.st_uid, st.st_gid) ||
-        setfilecon(dest, con));
-    freecon(con);
-    return (ret)? -1 : 0;
+    // O_PATH fds of device nodes only take xattrs through /proc
+    STAT_INC(syscalls);
+    return setxattr(fd_path(fd).data(), "security.selinux", con, strlen(con) + 1, 0);
 }
 
-struct item_node
+// files up to this size are copied into the tmpfs instead of bind mounted, -1 never
+static long long inline_max = -1;
+
+// copy size bytes of src_fd to dest_fd, with sendfile where the kernel does
+// not copy_file_range between the two filesystems
+static bool copy_data(int src_fd, int dest_fd, off_t size)
 {
-    std::string src;
-    std::string dest;
-    struct stat st;
-    bool ignore = false;
+    static std::atomic<bool> no_copy_range{false};
+    off_t done = 0;
+    while (done < size) {
+        ssize_t n;
+        STAT_INC(syscalls);
+        if (!no_copy_range) {
+            n = syscall(__NR_copy_file_range, src_fd, nullptr, dest_fd, nullptr, size - done, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                no_copy_range = true;
+                continue;
+            }
+        } else {
+            n = sendfile(dest_fd, src_fd, nullptr, size - done);
+        }
+        if (n <= 0)
+            return n == 0; // the file shrank
+        done += n;
+    }
+    return true;
+}
 
-    int get_mode()
-    {
-        lstat(src.data(), &st);
-        if (S_ISDIR(st.st_mode))
-            return 0;
-        if (S_ISREG(st.st_mode))
-            return 1;
-        if (S_ISFIFO(st.st_mode))
-            return 2;
-        if (S_ISLNK(st.st_mode))
-            return 3;
-        if (S_ISBLK(st.st_mode))
-            return 4;
-        if (S_ISCHR(st.st_mode) && st.st_rdev > 0)
-            return 5;
+// copy the file open in src_fd into the placeholder dest_fd with its mode,
+// owner, context and times
+static bool inline_file(const struct stat &st, int src_fd, int dest_fd)
+{
+    const char *con;
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    STAT_INC(inlined_files);
+    STAT_ADD(inlined_bytes, st.st_size);
+    STAT_INC(syscalls);
+    return copy_data(src_fd, dest_fd, st.st_size) &&
+        getcon_interned(src_fd, "", &con) == 0 &&
+        set_attr(dest_fd, st.st_mode, st.st_uid, st.st_gid, con, false, nullptr) == 0 &&
+        futimens(dest_fd, times) == 0;
+}
+
+// copy the regular file src to dest with its mode, owner and context
+static bool clone_file(const char *src, const char *dest)
+{
+    unique_fd in_fd(open(src, O_RDONLY | O_NOATIME | O_CLOEXEC));
+    unique_fd out_fd(open(dest, O_RDWR | O_CREAT | O_CLOEXEC, 0666));
+    struct stat st{};
+    const char *con;
+    return in_fd >= 0 && out_fd >= 0 &&
+        statx_mask(in_fd, "", AT_EMPTY_PATH, ATTR_MASK | STATX_SIZE, &st) == 0 &&
+        getcon_interned(in_fd, "", &con) == 0 &&
+        copy_data(in_fd, out_fd, st.st_size) &&
+        set_attr(out_fd, st.st_mode, st.st_uid, st.st_gid, con, false, nullptr) == 0;
+}
+
+// -b for every "SRC DEST" line of manifest: all files are copied into the
+// workdir tmpfs first, then bound in one pass. Failed entries are reported
+// and skipped, returns their number or -1 if manifest cannot be read.
+static int clone_manifest(const char *manifest, const char *workdir)
+{
+    FILE *fp = fopen(manifest, "re");
+    if (fp == nullptr)
         return -1;
+    struct entry {
+        std::string src, dest, file;
+    };
+    std::vector<entry> entries;
+    int failed = 0;
+    char *line = nullptr;
+    size_t cap = 0;
+    for (int lineno = 1; getline(&line, &cap, fp) >= 0; lineno++) {
+        char src[PATH_MAX], dest[PATH_MAX];
+        const char *p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0')
+            continue;
+        if (sscanf(p, "%4095s %4095s", src, dest) != 2) {
+            fprintf(stderr, "%s:%d: expected SRC DEST\n", manifest, lineno);
+            failed++;
+            continue;
+        }
+        entries.push_back({ src, dest, std::string(workdir) + "/" + std::to_string(entries.size()) });
+    }
+    free(line);
+    fclose(fp);
+
+    stats_phase(PHASE_MATERIALIZE);
+    for (auto &e : entries) {
+        if (!is_regfile(e.src.data(), true) || !is_regfile(e.dest.data(), true)) {
+            errno = EINVAL;
+        } else if (clone_file(e.src.data(), e.file.data())) {
+            continue;
+        }
+        fprintf(stderr, "mount: '%s'->'%s': %s\n", e.src.data(), e.dest.data(), std::strerror(errno));
+        e.file.clear();
+        failed++;
+    }
+    // bind mounts inherit the flags of the workdir mount, so one remount
+    // covers every file
+    stats_phase(PHASE_REMOUNT);
+    mount(nullptr, workdir, nullptr, MS_REMOUNT | mount_flags, nullptr);
+    stats_phase(PHASE_MOVE);
+    for (auto &e : entries) {
+        if (e.file.empty())
+            continue;
+        info_log("%s -> %s\n", "clone", e.src.data(), e.dest.data());
+        STAT_INC(bind_mounts);
+        if (mount(e.file.data(), e.dest.data(), nullptr, MS_BIND, nullptr)) {
+            fprintf(stderr, "mount: '%s'->'%s': %s\n", e.src.data(), e.dest.data(), std::strerror(errno));
+            failed++;
+        }
+    }
+    return failed;
+}
+
+// MS_* flags of a comma separated list of mount options, unknown ones are ignored
+static int parse_mount_flags(const char *list)
+{
+    int flags = 0;
+    for (auto &s : split_ro(list, ',')) {
+        if (s == "nosuid") {
+            flags |= MS_NOSUID;
+        } else if (s == "lazytime") {
+            flags |= MS_LAZYTIME;
+        } else if (s == "nodev") {
+            flags |= MS_NODEV;
+        } else if (s == "noexec") {
+            flags |= MS_NOEXEC;
+        } else if (s == "sync") {
+            flags |= MS_SYNCHRONOUS;
+        } else if (s == "dirsync") {
+            flags |= MS_DIRSYNC;
+        } else if (s == "noatime") {
+            flags |= MS_NOATIME;
+        } else if (s == "nodiratime") {
+            flags |= MS_NODIRATIME;
+        } else if (s == "relatime") {
+            flags |= MS_RELATIME;
+        } else if (s == "strictatime") {
+            flags |= MS_STRICTATIME;
+        } else if (s == "nosymfollow") {
+            flags |= MS_NOSYMFOLLOW;
+        } else if (s == "mand") {
+            flags |= MS_MANDLOCK;
+        } else if (s == "silent") {
+            flags |= MS_SILENT;
+        }
+    }
+    return flags;
+}
+
+// open fds of the bound layer dirs, index 0 is the merged tmpfs
+std::vector<int> layer_fds;
+
+// fill st for an entry of type d_type, only folders and device nodes need
+// more than the type, they are fetched from the opened folder fd if any
+static bool load_stat(int dirfd, const char *name, int fd, unsigned char d_type, struct stat &st)
+{
+    switch (d_type) {
+    case DT_REG:
+    case DT_FIFO:
+    case DT_LNK:
+        st.st_mode = DTTOIF(d_type);
+        return true;
     }
+    if (fd >= 0)
+        return statx_mask(fd, "", AT_EMPTY_PATH, ATTR_MASK, &st) == 0;
+    return statx_mask(dirfd, name, AT_SYMLINK_NOFOLLOW, ATTR_MASK, &st) == 0;
+}
+
+// whether the source of a node of mode is opened to be inlined
+static bool may_inline(int mode)
+{
+    return mode == 1 && inline_max >= 0;
+}
+
+bool item_node::do_mount(int src_dirfd, int dest_dirfd, const char *parent_con, mount_prep &prep)
+{
+    int mode = get_mode();
+    const char *src_name = name();
+    const char *dest_name = name();
 
-    bool do_mount()
+    switch (mode)
     {
-        int mode = get_mode();
+    case 0:
+    { // DIRECTORY
+        verbose_log("0%s <- %d%s\n", "mkdir", path().data(), layer, path().data());
+        STAT_INC(dirs);
+        if (prep.created == 1) {
+            STAT_INC(syscalls);
+            prep.created = mkdirat(dest_dirfd, dest_name, st_mode & 0777)? -errno : 0;
+        }
+        if (prep.created == 0)
+            STAT_INC(mkdirs);
+        if (prep.dest < 0) {
+            STAT_INC(syscalls);
+            prep.dest.reset(openat(dest_dirfd, dest_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+        }
+        if (prep.dest < 0)
+            return false;
+        if (opaque) {
+            verbose_log("0%s marked as trusted opaque\n", "magic_mount", path().data());
+            STAT_INC(opaque);
+        }
+        if (unmerged) {
+            verbose_log("0%s marked as unmerged folder\n", "magic_mount", path().data());
+            STAT_INC(unmerged);
+        }
+        // a folder bind mounted as a whole covers this one
+        prep.bind = bind_dir;
+        return bind_dir || set_attr(prep.dest, st_mode, st_uid, st_gid, con, prep.created == 0, parent_con) == 0;
+        break;
+    }
+    case 1:
+    case 2:
+    { // FILE / FIFO
+        if (mode == 1)
+            STAT_INC(files);
+        else
+            STAT_INC(fifos);
+        if (prep.src < 0 && may_inline(mode)) {
+            STAT_INC(syscalls);
+            prep.src.reset(openat(src_dirfd, src_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+        }
+        if (prep.dest < 0) {
+            STAT_INC(syscalls);
+            prep.dest.reset(openat(dest_dirfd, dest_name, O_RDWR | O_CREAT | O_CLOEXEC, 0755));
+        }
+        if (prep.src >= 0 && prep.dest >= 0) {
+            struct stat src_st;
+            STAT_INC(syscalls);
+            if (fstat(prep.src, &src_st) == 0 && src_st.st_size <= inline_max) {
+                verbose_log("0%s <- %d%s\n", "inline", path().data(), layer, path().data());
+                bool ret = inline_file(src_st, prep.src, prep.dest);
+                prep.src.reset();
+                prep.dest.reset();
+                return ret;
+            }
+        }
+        bool ret = prep.dest >= 0 && (prep.src >= 0 || !may_inline(mode));
+        prep.bind = true;
+        prep.src.reset();
+        prep.dest.reset();
+        return ret;
+        break;
+    }
+    case 3:
+    { // SYMLINK
+        verbose_log("0%s <- %d%s\n", "symlink", path().data(), layer, path().data());
+        STAT_INC(symlinks);
+        if (prep.created == 1) {
+            char buf[PATH_MAX];
+            STAT_INC(syscalls);
+            ssize_t n = readlinkat(src_dirfd, src_name, buf, sizeof(buf) - 1);
+            if (n < 0)
+                return false;
+            buf[n] = '\0';
+            STAT_INC(syscalls);
+            prep.created = symlinkat(buf, dest_dirfd, dest_name)? -errno : 0;
+        }
+        if (prep.created == 0)
+            STAT_INC(symlink_creates);
+        return prep.created == 0;
+        break;
+    }
+    case 4:
+    { // BLOCK
+        verbose_log("0%s <- %d%s\n", "mknod_blk", path().data(), layer, path().data());
+        STAT_INC(block_devs);
+        STAT_INC(mknods);
+        STAT_ADD(syscalls, 2);
+        if (mknodat(dest_dirfd, dest_name, S_IFBLK | (st_mode & 0777), st_rdev))
+            return false;
+        unique_fd fd(openat(dest_dirfd, dest_name, O_PATH | O_NOFOLLOW | O_CLOEXEC));
+        return fd >= 0 && set_attr(fd, st_mode, st_uid, st_gid, con, true, parent_con) == 0;
+    }
+    case 5:
+    { // CHAR
+        verbose_log("0%s <- %d%s\n", "mknod_chr", path().data(), layer, path().data());
+        STAT_INC(char_devs);
+        STAT_INC(mknods);
+        STAT_ADD(syscalls, 2);
+        if (mknodat(dest_dirfd, dest_name, S_IFCHR | (st_mode & 0777), st_rdev))
+            return false;
+        unique_fd fd(openat(dest_dirfd, dest_name, O_PATH | O_NOFOLLOW | O_CLOEXEC));
+        return fd >= 0 && set_attr(fd, st_mode, st_uid, st_gid, con, true, parent_con) == 0;
+    }
+    default:
+    { // WHITEOUT
+        // do nothing
+        verbose_log("0%s <- %d%s\n", "ignore", path().data(), layer, path().data());
+        STAT_INC(whiteouts);
+        return true;
+        break;
+    }
+    }
+}
+
+// an entry found in one layer, dirfd is its parent folder in that layer
+struct candidate
+{
+    int layer;
+    int dirfd;
+    unsigned char d_type;
+    bool merged; // false if the layer only tells whether lower layers hold the entry
+    int fd = -1; // the folder, if it was opened ahead
+    const struct stat *st = nullptr; // attributes, if they were fetched ahead
+};
+
+// a layer folder to read, merged as for candidate
+struct layer_dir
+{
+    int layer;
+    int fd;
+    bool merged;
+};
 
-        switch (mode)
+static int scan_threads = 0;
+static const char *plan_file = nullptr;
+static std::atomic<bool> scan_failed{false};
+// errno of the first failure of the scan
+static std::atomic<int> scan_errno{0};
+static bool use_io_uring = false;
+static const char *stats_file = nullptr;
+// patch the mounted tree instead of mounting a new one
+static bool update_tree = false;
+// mount IDs of the attached trees are appended here
+static const char *state_file = nullptr;
+// merge folders with a read-only overlayfs where the kernel can
+static bool use_overlay = false;
+static const char *overlay_name = "overlay";
+// serve files from the lowest layer with the same file
+static bool dedupe_files = false;
+// provenance index of the mounted tree, with the folders of its layers
+static const char *index_file = nullptr;
+static std::vector<std::string> index_layers;
+// -N: more mount namespaces that get the tree, each a pid or namespace file
+static std::vector<const char *> ns_targets;
+
+// -d: serve the regular file of node, from candidate c, from the lowest layer
+// below whose file is the same, see same_file(). Errors only end the search.
+static void dedupe_file(item_node &node, const candidate *c, const candidate *end, const char *name)
+{
+    if (c + 1 == end || !c[1].merged || c[1].d_type != DT_REG)
+        return;
+    struct stat st;
+    const char *con;
+    STAT_ADD(syscalls, 2);
+    unique_fd fd(openat(c->dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+    if (fd < 0 || fstat(fd, &st) || getcon_interned(fd, "", &con))
+        return;
+    for (auto *l = c + 1; l < end && l->merged && l->d_type == DT_REG; l++) {
+        struct stat lst;
+        const char *lcon;
+        STAT_ADD(syscalls, 2);
+        unique_fd lfd(openat(l->dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+        if (lfd < 0 || fstat(lfd, &lst) || getcon_interned(lfd, "", &lcon) ||
+            !same_file(fd, st, con, lfd, lst, lcon))
+            break;
+        verbose_log("%d%s same as %d%s\n", "dedupe", node.layer, node.path().data(), l->layer, node.path().data());
+        STAT_INC(deduped);
+        node.layer = l->layer;
+        fd = std::move(lfd);
+        st = lst;
+        con = lcon;
+    }
+}
+
+// decide how node is merged from the layers holding it, in layer order
+// for a merged folder, dirs receives the opened folder of every layer to scan
+static bool merge_node(item_node &node, std::vector<candidate> &cands, std::vector<layer_dir> &dirs)
+{
+    const char *name = node.name();
+    // lowest layer holding this entry as a folder, replaces probing every
+    // lower layer for "<layer>/<path>" to find unmerged folders
+    int last_dir = 0;
+    // a type that d_type did not tell is fetched with everything the upper
+    // entry needs, so it is not fetched again when that entry creates the node
+    struct stat upper_st;
+    const candidate *upper = nullptr;
+    bool merged = false;
+    // layers merged into a folder, stored in node at the end
+    std::vector<uint16_t> layers;
+    for (auto &c : cands) {
+        if (c.d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (statx_mask(c.dirfd, name, AT_SYMLINK_NOFOLLOW, ATTR_MASK, &st))
+                return false;
+            c.d_type = IFTODT(st.st_mode);
+            if (c.merged && !merged) {
+                upper_st = st;
+                upper = &c;
+            }
+        }
+        merged |= c.merged;
+        if (c.d_type == DT_DIR)
+            last_dir = std::max(last_dir, c.layer);
+    }
+    for (auto &c : cands) {
+        if (!c.merged)
+            continue;
+        struct stat st;
+        unique_fd fd;
+        if (c.d_type == DT_DIR) {
+            if (c.fd < 0)
+                STAT_INC(syscalls);
+            fd.reset((c.fd >= 0)? std::exchange(c.fd, -1) :
+                     openat(c.dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+            if (fd < 0)
+                return false;
+            STAT_INC(syscalls); // fstatfs
+            if (!is_supported_fs(fd)) {
+                verbose_log("ignore src=[%d%s] unsupported fs\n", "magic_mount", c.layer, node.path().data());
+                continue; // no magic mount /proc
+            }
+        }
+        bool first = false;
+        if (node.layer == 0) {
+            if (&c == upper)
+                st = upper_st;
+            else if (c.st)
+                st = *c.st;
+            else if (!load_stat(c.dirfd, name, fd, c.d_type, st))
+                return false;
+            node.layer = c.layer;
+            node.set_stat(st);
+            first = true && !full_magic_mount;
+            if (S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode))
+                return getcon_interned(c.dirfd, name, &node.con) == 0;
+            if (dedupe_files && S_ISREG(st.st_mode))
+                dedupe_file(node, &c, cands.data() + cands.size(), name);
+            if (!S_ISDIR(st.st_mode)) // mounted (upper) node is regular file
+                return true;
+        } else if (c.d_type != DT_DIR) { // regular file
+            break;
+        }
         {
-        case 0:
-        { // DIRECTORY
-            verbose_log("%s <- %s\n", "mkdir", dest.data(), src.data());
-            mkdir(dest.data(), 0);
-            return clone_attr(src.data(), dest.data()) == 0;
+            char trusted_opaque[3];
+            STAT_INC(syscalls);
+            STAT_INC(xattr_reads);
+            ssize_t ret = fgetxattr(fd, "trusted.overlay.opaque", trusted_opaque, sizeof(trusted_opaque));
+            if (ret == 1 && trusted_opaque[0] == 'y') {
+                node.opaque = true;
+                if (first) {
+                    node.bind_dir = true;
+                    return true;
+                }
+                // merge this layer, ignore the lower ones
+                if (layers.empty() && getcon_interned(fd, "", &node.con))
+                    return false;
+                layers.push_back(c.layer);
+                dirs.push_back({ c.layer, fd.release(), true });
+                break;
+            }
+        }
+        // test if this position does not exist in lower layer
+        if (first && last_dir <= c.layer) {
+            // marked as unmerged folder to reduce wasting magic mount
+            node.unmerged = true;
+            node.bind_dir = true;
+            return true;
+        }
+        // attributes are only cloned to folders that are not covered by a bind
+        if (layers.empty() && getcon_interned(fd, "", &node.con))
+            return false;
+        layers.push_back(c.layer);
+        dirs.push_back({ c.layer, fd.release(), true });
+    }
+    if (dirs.empty())
+        return true;
+    node.layers = arena_copy(layers.data(), layers.size());
+    // folders of the layers not merged here still feed the index of the children
+    for (auto &c : cands) {
+        if (c.d_type != DT_DIR ||
+            std::find(layers.begin(), layers.end(), c.layer) != layers.end())
+            continue;
+        STAT_ADD(syscalls, (c.fd >= 0)? 1 : 2);
+        unique_fd fd((c.fd >= 0)? std::exchange(c.fd, -1) :
+                     openat(c.dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+        if (fd >= 0 && is_supported_fs(fd))
+            dirs.push_back({ c.layer, fd.release(), false });
+    }
+    return true;
+}
+
+// children of a folder are merged in groups, the folders of a group are
+// opened ahead in one batch and closed before the next group
+#define SCAN_GROUP 128
+
+// fetch ahead what merge_node needs for children[0..n) of a folder, one batch
+// for the types d_type did not tell, one for the folders to open and the
+// attributes of the entries creating a node. stats keeps the attributes.
+static void prefetch(item_node *const *children, std::vector<candidate> *cands, size_t n,
+                     std::deque<struct stat> &stats)
+{
+    std::deque<struct statx> stx;
+    std::deque<int> res;
+    std::vector<candidate *> fetched;
+    auto fetch = [&](io_batch &batch, candidate &c, const char *name) {
+        stx.emplace_back();
+        res.push_back(0);
+        fetched.push_back(&c);
+        batch.statx(c.dirfd, name, AT_SYMLINK_NOFOLLOW, ATTR_MASK | STATX_TYPE, &stx.back(), &res.back());
+    };
+    auto collect = [&]() {
+        for (size_t i = 0; i < fetched.size(); i++) {
+            if (res[i] < 0)
+                continue; // merge_node fetches it again and reports the error
+            stats.emplace_back();
+            statx_to_stat(stx[i], ATTR_MASK, &stats.back());
+            fetched[i]->st = &stats.back();
+            fetched[i]->d_type = IFTODT(stats.back().st_mode);
+        }
+        stx.clear();
+        res.clear();
+        fetched.clear();
+    };
+    io_batch batch;
+    for (size_t i = 0; i < n; i++)
+        for (auto &c : cands[i])
+            if (c.d_type == DT_UNKNOWN)
+                fetch(batch, c, children[i]->name());
+    if (!batch.empty()) {
+        batch.submit();
+        collect();
+    }
+    for (size_t i = 0; i < n; i++) {
+        const char *name = children[i]->name();
+        bool upper = true;
+        for (auto &c : cands[i]) {
+            if (c.d_type == DT_DIR)
+                batch.openat(c.dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC, 0, &c.fd);
+            if (c.merged && upper) {
+                upper = false;
+                if (!c.st && (c.d_type == DT_DIR || c.d_type == DT_BLK || c.d_type == DT_CHR))
+                    fetch(batch, c, name);
+            }
+        }
+    }
+    batch.submit();
+    collect();
+}
+
+// end the scan on an error of path, err is kept for the report
+static void fail_scan(const std::string &path, int err)
+{
+    error_log("unable to scan %s: %s\n", "magic_mount", path.data(), std::strerror(err));
+    int none = 0;
+    scan_errno.compare_exchange_strong(none, err);
+    scan_failed = true;
+}
+
+// layer folders of a folder being scanned, shared with the tasks of its
+// child folders until each has opened its own
+struct scan_dirs
+{
+    std::vector<layer_dir> dirs;
+
+    ~scan_dirs()
+    {
+        for (auto &dir : dirs)
+            close(dir.fd);
+    }
+};
+
+static void scan_dir(thread_pool &pool, item_node *node, std::shared_ptr<scan_dirs> own);
+
+// queue the scan of the merged folder node, its folders in sub are opened
+// again by the task from those of the parent, so waiting tasks hold none
+static void queue_scan(thread_pool &pool, item_node *node, std::shared_ptr<scan_dirs> parent,
+                       std::vector<layer_dir> sub)
+{
+    for (auto &dir : sub)
+        close(std::exchange(dir.fd, -1));
+    pool.submit([&pool, node, parent, sub]() mutable {
+        auto own = std::make_shared<scan_dirs>();
+        for (auto &dir : sub) {
+            int dirfd = -1;
+            for (auto &p : parent->dirs)
+                if (p.layer == dir.layer)
+                    dirfd = p.fd;
+            STAT_INC(syscalls);
+            int fd = openat(dirfd, node->name(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) {
+                fail_scan(node->path(), errno);
+                return;
+            }
+            own->dirs.push_back({ dir.layer, fd, dir.merged });
+        }
+        parent.reset();
+        scan_dir(pool, node, std::move(own));
+    });
+}
+
+// read the folders of every layer merged into node and decide its children,
+// merged child folders are queued as new tasks
+static void scan_dir(thread_pool &pool, item_node *node, std::shared_ptr<scan_dirs> own)
+{
+    auto &dirs = own->dirs;
+    // -p: the plan is checked against these before it is replayed
+    if (plan_file) {
+        for (auto &dir : dirs) {
+            struct stat st;
+            STAT_INC(syscalls);
+            if (fstat(dir.fd, &st) == 0)
+                node->stamp += plan_stamp(dir.layer, st);
+        }
+    }
+    // children of this folder, stored in node once they are all decided
+    std::vector<item_node *> children;
+    // index in children by name
+    std::unordered_map<std::string_view, size_t> index;
+    std::vector<std::vector<candidate>> cands;
+    std::vector<char> dents;
+    // merged folders come first in dirs, only they create children
+    for (auto &dir : dirs) {
+        if (scan_failed)
+            break;
+        if (!read_dents(dir.fd, dents)) {
+            fail_scan(node->path(), errno);
             break;
         }
+        for_each_dent(dp, dents) {
+            if (strcmp(dp->d_name, ".") == 0 ||
+                strcmp(dp->d_name, "..") == 0)
+                continue;
+            auto it = index.find(dp->d_name);
+            size_t i;
+            if (it != index.end()) {
+                i = it->second;
+            } else if (dir.merged) {
+                i = children.size();
+                auto child = arena_new<item_node>();
+                child->parent = node;
+                child->base = intern_name(dp->d_name);
+                children.push_back(child);
+                cands.emplace_back();
+                index.emplace(child->base, i);
+            } else {
+                continue;
+            }
+            cands[i].push_back({ dir.layer, dir.fd, dp->d_type, dir.merged });
+        }
+    }
+    std::deque<struct stat> stats;
+    for (size_t i = 0; i < cands.size() && !scan_failed; i += SCAN_GROUP) {
+        size_t n = std::min(cands.size() - i, (size_t) SCAN_GROUP);
+        stats.clear();
+        if (io_batch::enabled())
+            prefetch(&children[i], &cands[i], n, stats);
+        for (size_t j = i; j < i + n && !scan_failed; j++) {
+            item_node *child = children[j];
+            std::vector<layer_dir> sub;
+            if (!merge_node(*child, cands[j], sub))
+                fail_scan(child->path(), errno);
+            if (!sub.empty())
+                queue_scan(pool, child, own, std::move(sub));
+        }
+        // folders opened ahead that merging did not take
+        for (size_t j = i; j < i + n; j++)
+            for (auto &c : cands[j])
+                if (c.fd >= 0)
+                    close(std::exchange(c.fd, -1));
+    }
+    // drop names that no supported layer provides
+    children.erase(std::remove_if(children.begin(), children.end(),
+                                  [](const item_node *n) { return n->layer == 0; }), children.end());
+    node->children = arena_copy(children.data(), children.size());
+}
+
+// children of a folder are mounted in groups, the skeleton of a group is
+// created ahead in one batch
+#define MOUNT_GROUP 64
+
+// batch what do_mount does for each of children[0..n): folders and
+// symlinks are created, placeholder files and files to inline opened
+static void prepare(item_node *const *children, size_t n, const std::vector<int> &src_fds,
+                    int dest_dirfd, std::vector<mount_prep> &preps)
+{
+    io_batch batch;
+    std::vector<std::string> targets(n);
+    for (size_t i = 0; i < n; i++) {
+        item_node &node = *children[i];
+        mount_prep &p = preps[i];
+        const char *name = node.name();
+        int src_dirfd = src_fds[node.layer];
+        switch (node.get_mode()) {
+        case 0:
+            batch.mkdirat(dest_dirfd, name, node.st_mode & 0777, &p.created);
+            break;
         case 1:
         case 2:
-        { // FILE / FIFO
-            verbose_log("%s <- %s\n", "bind_mnt", dest.data(), src.data());
-            return close(open(dest.data(), O_RDWR | O_CREAT, 0755)) == 0 &&
-                mount(src.data(), dest.data(), nullptr, MS_BIND | mount_flags, nullptr) == 0;
+            if (may_inline(node.get_mode()))
+                batch.openat(src_dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC, 0, &p.src.fd);
+            batch.openat(dest_dirfd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0755, &p.dest.fd);
             break;
-        }
-        case 3:
-        { // SYMLINK
+        case 3: {
+            // no io_uring opcode reads links
             char buf[PATH_MAX];
-            ssize_t n = readlink(src.data(), buf, sizeof(buf));
-            verbose_log("%s <- %s\n", "symlink", dest.data(), src.data());
-            if (n >= 0) {
-                buf[n] = '\0';
-                return symlink(buf, dest.data()) == 0;
+            STAT_INC(syscalls);
+            ssize_t len = readlinkat(src_dirfd, name, buf, sizeof(buf) - 1);
+            if (len >= 0) {
+                targets[i].assign(buf, len);
+                batch.symlinkat(targets[i].data(), dest_dirfd, name, &p.created);
             }
-            return false;
             break;
         }
-        case 4:
-        { // BLOCK
-            verbose_log("%s <- %s\n", "mknod_chr", dest.data(), src.data());
-            return mknod(dest.data(), S_IFBLK, st.st_rdev) == 0 &&
-                clone_attr(src.data(), dest.data()) == 0;
-        }
-        case 5:
-        { // CHAR
-            verbose_log("%s <- %s\n", "mknod_blk", dest.data(), src.data());
-            return mknod(dest.data(), S_IFCHR, st.st_rdev) == 0 &&
-                clone_attr(src.data(), dest.data()) == 0;
-        }
-        default:
-        { // WHITEOUT
-            // do nothing
-            verbose_log("%s <- %s\n", "ignore", dest.data(), src.data());
-            return true;
-            break;
         }
+    }
+    batch.submit();
+    // created folders are opened in a second round
+    for (size_t i = 0; i < n; i++) {
+        mount_prep &p = preps[i];
+        if (children[i]->get_mode() == 0 && (p.created == 0 || p.created == -EEXIST))
+            batch.openat(dest_dirfd, children[i]->name(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC,
+                         0, &p.dest.fd);
+    }
+    batch.submit();
+}
+
+// whether overlayfs is tried for the merged folder node. A parent that failed
+// with the same layers tells it would fail again. Layers bound with -r have
+// mounts below that overlayfs does not merge.
+static bool try_overlay(const item_node &node)
+{
+    if (!use_overlay || (mount_flags & MS_REC) || node.overlay < 0 || node.layers.size() < 2)
+        return false;
+    const item_node *p = node.parent;
+    return p == nullptr || p->overlay >= 0 ||
+        !std::equal(node.layers.begin(), node.layers.end(), p->layers.begin(), p->layers.end());
+}
+
+// merge the layer folders lowers, top first, by a read-only overlayfs on top
+// of dest_fd, false if the caller has to merge them itself
+static bool overlay_mount(const std::vector<std::string> &lowers, int dest_fd)
+{
+    STAT_ADD(syscalls, lowers.size() + 5);
+    unique_fd mnt(fsmount_overlay(overlay_name, lowers));
+    int ret = -1;
+    if (mnt >= 0) {
+        ret = sys_move_mount(mnt, "", dest_fd, "", MOVE_MOUNT_F_EMPTY_PATH | MOVE_MOUNT_T_EMPTY_PATH);
+    } else if (!detached_tree) {
+        // no new mount api or paths too long for fsconfig, mount(2) takes
+        // a page of options
+        std::string opts = "lowerdir=";
+        for (size_t i = 0; i < lowers.size(); i++)
+            opts += (i? ":" : "") + lowers[i];
+        if (opts.size() < (size_t) getpagesize()) {
+            STAT_INC(syscalls);
+            ret = mount(overlay_name, fd_path(dest_fd).data(), "overlay", MS_RDONLY, opts.data());
+        } else {
+            errno = ENAMETOOLONG;
         }
     }
+    if (ret)
+        return false;
+    STAT_INC(overlay_mounts);
+    return true;
+}
+
+// bind node from the same name under src_dirfd onto its placeholder under dest_dirfd
+static bool bind_node(const item_node &node, int src_dirfd, int dest_dirfd)
+{
+    const char *name = node.name();
+    verbose_log("0%s <- %d%s\n", "bind_mnt", node.path().data(), node.layer, node.path().data());
+    STAT_INC(bind_mounts);
+    STAT_ADD(syscalls, detached_tree? 2 : 1);
+    if (detached_tree)
+        return clone_mount_at(src_dirfd, name, dest_dirfd, name, mount_flags & MS_REC) == 0;
+    return mount(at_path(src_dirfd, name).data(), at_path(dest_dirfd, name).data(), nullptr,
+                 MS_BIND | mount_flags, nullptr) == 0;
+}
+
+// a merged folder of the skeleton, with the binds it waits for
+struct skel_dir
+{
+    item_node *node;
+    std::vector<const item_node *> binds;        // children left to the bind pass
+    std::vector<std::unique_ptr<skel_dir>> subs; // merged child folders with binds below
+};
+
+// a merged folder opened in each of its layers and in the tmpfs
+struct folder_fds
+{
+    std::vector<int> src; // by layer, -1 for the other layers
+    unique_fd dest;
+
+    ~folder_fds()
+    {
+        for (int fd : src)
+            if (fd >= 0) close(fd);
+    }
 };
 
-std::vector<item_node> item;
+// open node from its parent folder, in the layers src_fds and under dest_dirfd
+static bool open_folder(const item_node &node, const std::vector<int> &src_fds, int dest_dirfd,
+                        int dest_flags, folder_fds &f)
+{
+    f.src.assign(src_fds.size(), -1);
+    STAT_ADD(syscalls, node.layers.size() + 1);
+    f.dest.reset(openat(dest_dirfd, node.name(), dest_flags | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+    if (f.dest < 0)
+        return false;
+    for (int layer : node.layers) {
+        if ((f.src[layer] = openat(src_fds[layer], node.name(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+            return false;
+    }
+    return true;
+}
+
+// first stage of magic_mount, one task per merged folder: the children of
+// dir, open in f, are created in the tmpfs with their attributes, files and
+// folders bound as a whole are only recorded in dir.binds. Merged child
+// folders are queued as new tasks, which open themselves from f and let go
+// of it, so open folders stay few however many tasks wait.
+static void build_skeleton(thread_pool &pool, skel_dir &dir, std::shared_ptr<folder_fds> f,
+                           std::atomic<bool> &failed)
+{
+    item_node &node = *dir.node;
+    if (try_overlay(node)) {
+        std::vector<std::string> lowers;
+        for (int layer : node.layers)
+            lowers.push_back(fd_path(f->src[layer]));
+        node.overlay = overlay_mount(lowers, f->dest)? 1 : -1;
+        if (node.overlay > 0) {
+            verbose_log("0%s merged by overlayfs of %zu layers\n", "magic_mount", node.path().data(), lowers.size());
+        } else {
+            verbose_log("0%s overlayfs failed: %s\n", "magic_mount", node.path().data(), std::strerror(errno));
+        }
+    }
+    auto &children = node.children;
+    for (size_t i = 0; !failed && node.overlay <= 0 && i < children.size(); i += MOUNT_GROUP) {
+        size_t n = std::min(children.size() - i, (size_t) MOUNT_GROUP);
+        std::vector<mount_prep> preps(n);
+        if (io_batch::enabled())
+            prepare(&children[i], n, f->src, f->dest, preps);
+        for (size_t j = 0; j < n; j++) {
+            item_node &child = *children[i + j];
+            if (!child.do_mount(f->src[child.layer], f->dest, node.con, preps[j])) {
+                failed = true;
+                return;
+            }
+            if (preps[j].bind) {
+                dir.binds.push_back(&child);
+                continue;
+            }
+            if (child.get_mode() != 0)
+                continue;
+            dir.subs.emplace_back(new skel_dir{ &child, {}, {} });
+            skel_dir *s = dir.subs.back().get();
+            pool.submit([&pool, s, f, &failed]() mutable {
+                auto own = std::make_shared<folder_fds>();
+                bool ok = open_folder(*s->node, f->src, f->dest, O_RDONLY, *own);
+                f.reset();
+                if (!ok)
+                    failed = true;
+                else
+                    build_skeleton(pool, *s, std::move(own), failed);
+            });
+        }
+    }
+}
+
+// drop the folders below dir that hold no binds, false if dir holds none either
+static bool prune(skel_dir &dir)
+{
+    auto &subs = dir.subs;
+    subs.erase(std::remove_if(subs.begin(), subs.end(),
+                              [](std::unique_ptr<skel_dir> &sub) { return !prune(*sub); }), subs.end());
+    return !dir.binds.empty() || !subs.empty();
+}
 
-inline struct item_node *find_node_by_dest(std::string_view dest)
+// second stage of magic_mount: every bind the skeleton left, folder by
+// folder in tree order. Each folder is opened again from its parent, in
+// src_fds and under dest_dirfd, and stays open only while its subtree is bound.
+static bool bind_pass(const skel_dir &dir, const std::vector<int> &src_fds, int dest_dirfd)
 {
-    for (auto it = item.begin(); it != item.end(); it++)
-        if (std::string_view(it->dest) == dest)
-            return (struct item_node *)&(*it);
-    return nullptr;
+    folder_fds f;
+    bool ret = open_folder(*dir.node, src_fds, dest_dirfd, O_PATH, f);
+    for (size_t i = 0; ret && i < dir.binds.size(); i++)
+        ret = bind_node(*dir.binds[i], f.src[dir.binds[i]->layer], f.dest);
+    for (size_t i = 0; ret && i < dir.subs.size(); i++)
+        ret = bind_pass(*dir.subs[i], f.src, f.dest);
+    return ret;
 }
 
-static bool magic_mount(const char *src, const char *target, int layer_number)
+// mount node from the layer folders in src_fds (indexed by layer) onto dest_dirfd.
+// Creating tmpfs nodes and setting their attributes scales across threads,
+// mounting serializes on the namespace lock, so the whole skeleton is built
+// on a pool first and the binds follow in one pass.
+static bool magic_mount(item_node &node, const std::vector<int> &src_fds, int dest_dirfd,
+                        const char *parent_con, mount_prep &prep)
 {
-    if (!is_supported_fs(src)) {
-        verbose_log("ignore src=[%s] unsupported fs\n", "magic_mount", src);
-        return true; // no magic mount /proc
+    umask_scope umask0;
+    int src_dirfd = src_fds[node.layer];
+    if (!node.do_mount(src_dirfd, dest_dirfd, parent_con, prep))
+        return false;
+    if (prep.bind) {
+        stats_phase(PHASE_BINDS);
+        bool ret = bind_node(node, src_dirfd, dest_dirfd);
+        stats_phase(PHASE_MATERIALIZE);
+        return ret;
     }
+    if (node.get_mode() != 0)
+        return true;
+    skel_dir dir{ &node, {}, {} };
+    auto f = std::make_shared<folder_fds>();
+    if (!open_folder(node, src_fds, dest_dirfd, O_RDONLY, *f))
+        return false;
+    prep.dest.reset();
+    std::atomic<bool> failed{false};
     {
+        thread_pool pool(scan_threads);
+        pool.submit([&pool, &dir, f, &failed] { build_skeleton(pool, dir, f, failed); });
+        f.reset();
+        pool.wait();
+    }
+    if (failed)
+        return false;
+    if (!prune(dir))
+        return true;
+    stats_phase(PHASE_BINDS);
+    bool ret = bind_pass(dir, src_fds, dest_dirfd);
+    stats_phase(PHASE_MATERIALIZE);
+    return ret;
+}
+
+// queue the scan of the layers in fds[1..] into root on pool, the tree is
+// complete after pool.wait() unless scan_failed is set
+static bool scan_start(thread_pool &pool, item_node &root, const std::vector<int> &fds)
+{
+    std::vector<candidate> cands;
+    for (size_t i=1; i < fds.size(); i++)
+        cands.push_back({ (int) i, fds[i], DT_UNKNOWN, true });
+    auto own = std::make_shared<scan_dirs>();
+    if (!merge_node(root, cands, own->dirs))
+        return false;
+    if (!own->dirs.empty())
+        pool.submit([&pool, &root, own] { scan_dir(pool, &root, own); });
+    return true;
+}
+
+// -d: a merged folder whose entries all come from one layer, folders
+// included, shows just what the folder of that layer holds. It is bound whole
+// from there if its own attributes match as well. Returns that layer, 0 if
+// node mixes layers.
+static int collapse(item_node &node, const std::vector<int> &src_fds)
+{
+    if (!S_ISDIR(node.st_mode))
+        return node.get_mode() < 0? 0 : node.layer;
+    if (node.bind_dir)
+        return node.layer;
+    int layer = -1;
+    bool mixed = false;
+    for (auto *child : node.children) {
+        int l = collapse(*child, src_fds);
+        if (layer < 0)
+            layer = l;
+        mixed |= l == 0 || l != layer;
+    }
+    if (mixed)
+        return 0;
+    if (layer < 0) // empty
+        layer = node.layer;
+    if (std::find(node.layers.begin(), node.layers.end(), layer) == node.layers.end())
+        return 0;
+    std::string path = node.path();
+    if (layer != node.layer) {
+        const char *rel = path.empty()? "." : path.data() + 1;
         struct stat st;
-        auto s = find_node_by_dest(target);
-        struct item_node m;
-        m.src = src;
-        m.dest = target;
-        int mode = m.get_mode();
-        bool first = false;
-        if (s == nullptr) {
-            item.emplace_back(m);
-            if (!m.do_mount())
-                return false;
-            s = &(item.back());
-            first = true && !full_magic_mount;
+        const char *con;
+        STAT_INC(syscalls);
+        if (statx_mask(src_fds[layer], rel, AT_SYMLINK_NOFOLLOW, ATTR_MASK, &st) ||
+            getcon_interned(src_fds[layer], rel, &con) ||
+            st.st_mode != node.st_mode || st.st_uid != node.st_uid || st.st_gid != node.st_gid || con != node.con)
+            return 0;
+    }
+    verbose_log("%d%s holds the whole folder\n", "dedupe", layer, path.data());
+    STAT_INC(collapsed);
+    node.layer = layer;
+    node.bind_dir = true;
+    node.children = {};
+    node.layers = {};
+    return layer;
+}
+
+// scan the layers in layer_fds[1..] into one merged tree
+static bool scan_layers(item_node &root)
+{
+    thread_pool pool(scan_threads);
+    if (!scan_start(pool, root, layer_fds))
+        return false;
+    pool.wait();
+    if (scan_failed) {
+        errno = scan_errno;
+        return false;
+    }
+    if (root.layer == 0) {
+        errno = EINVAL; // no supported layer
+        return false;
+    }
+    if (dedupe_files && !full_magic_mount)
+        collapse(root, layer_fds);
+    return true;
+}
+
+// write the provenance index of the tree root if -P asked for one
+static void write_index(const item_node &root)
+{
+    if (index_file == nullptr)
+        return;
+    info_log("save index=[%s]\n", "index", index_file);
+    if (!save_index(index_file, root, index_layers))
+        error_log("unable to save index=[%s]\n", "error", index_file);
+}
+
+// -O fast path: the layer folders in layer_fds[1..] merged by one read-only
+// overlayfs, without any scan. In detached mode the overlayfs is the tree
+// itself and its mount is returned, otherwise it is stacked on the workdir
+// tmpfs layer_fds[0] and 0 returned. -1 where the kernel cannot.
+static int overlay_layers()
+{
+    if (!use_overlay || (mount_flags & MS_REC) || layer_fds.size() < 3)
+        return -1;
+    stats_phase(PHASE_MATERIALIZE);
+    std::vector<std::string> lowers;
+    for (size_t i = 1; i < layer_fds.size(); i++)
+        lowers.push_back(fd_path(layer_fds[i]));
+    int ret = -1;
+    if (detached_tree) {
+        STAT_ADD(syscalls, lowers.size() + 4);
+        if ((ret = fsmount_overlay(overlay_name, lowers)) >= 0)
+            STAT_INC(overlay_mounts);
+    } else if (overlay_mount(lowers, layer_fds[0])) {
+        ret = 0;
+    }
+    if (ret < 0) {
+        info_log("overlayfs failed: %s, magic mount instead\n", "overlay", std::strerror(errno));
+        return -1;
+    }
+    info_log("%zu layers merged by overlayfs\n", "overlay", lowers.size());
+    // no single layer serves the tree
+    item_node root;
+    root.st_mode = S_IFDIR;
+    root.overlay = 1;
+    write_index(root);
+    return ret;
+}
+
+// swap the tmpfs in layer_fds[0] for an empty one named mnt_name under the
+// same fd, whatever was created or bound in the old one goes with it
+static bool reset_tmpfs(const char *mnt_name)
+{
+    stats_phase(PHASE_WORKDIR);
+    unique_fd fd;
+    if (detached_tree) {
+        fd.reset(fsmount_tmpfs(mnt_name));
+    } else if (umount2("0", MNT_DETACH) == 0 && mount(mnt_name, "0", "tmpfs", 0, nullptr) == 0) {
+        fd.reset(open("0", O_PATH | O_DIRECTORY | O_CLOEXEC));
+    }
+    return fd >= 0 && dup3(fd, layer_fds[0], O_CLOEXEC) >= 0;
+}
+
+// scan all layers into one merged tree, then mount it onto layer_fds[0], a
+// tmpfs named mnt_name. reason tells why the scan failed.
+static bool magic_mount_layers(const char *mnt_name, const char *&reason)
+{
+    item_node root;
+    uint64_t key = 0;
+    bool replay = false;
+    // moved onto the target alone, the tmpfs stays behind in the workdir
+    if (!detached_tree && overlay_layers() == 0)
+        return true;
+    // the fast path tried the root already
+    if (use_overlay)
+        root.overlay = -1;
+    stats_phase(PHASE_DISCOVERY);
+    if (plan_file) {
+        key = plan_key(layer_fds, _argv, full_magic_mount | dedupe_files << 1);
+        replay = load_plan(plan_file, root, _argc - 1, key);
+        if (replay && !check_plan(root, layer_fds)) {
+            warn_log("plan=[%s] is out of date, scan the layers\n", "plan", plan_file);
+            replay = false;
+            root = item_node();
+            if (use_overlay)
+                root.overlay = -1;
         }
-        if (s && (s->ignore || // trusted opaque
-                   s->get_mode() != 0 /* mounted (upper) node is regular file */))
-            return true;
-        if (!S_ISDIR(m.st.st_mode) || // regular file
-            (lstat(src, &st) == 0 && !S_ISDIR(st.st_mode))) {
-            s->ignore = true;
-            return true;
+        if (replay)
+            info_log("replay plan=[%s]\n", "plan", plan_file);
+    }
+    for (;;) {
+        if (!replay && !scan_layers(root)) {
+            reason = std::strerror(errno);
+            return false;
         }
-        {
-            char *trusted_opaque = new char[3];
-            ssize_t ret = getxattr(src, "trusted.overlay.opaque", trusted_opaque, 3*sizeof(char));
-            if (ret == 1 && trusted_opaque[0] == 'y') {
-                verbose_log("%s marked as trusted opaque\n", "magic_mount", target);
-                s->ignore = true;
-                if (first) return mount(src, target, nullptr, MS_BIND | mount_flags, nullptr) == 0;
+        stats_phase(PHASE_MATERIALIZE);
+        root_bound = root.bind_dir;
+        mount_prep prep;
+        if (magic_mount(root, layer_fds, layer_fds[0], nullptr, prep))
+            break;
+        if (!replay)
+            return false;
+        // layers changed below their roots, the key only covers the roots
+        warn_log("plan=[%s] is out of date, scan the layers\n", "plan", plan_file);
+        unlink(plan_file);
+        if (!reset_tmpfs(mnt_name))
+            return false;
+        replay = false;
+        root = item_node();
+        if (use_overlay)
+            root.overlay = -1;
+        stats_phase(PHASE_DISCOVERY);
+    }
+    struct statfs sfs;
+    if (fstatfs(layer_fds[0], &sfs) == 0)
+        stats.tmpfs_bytes = (uint64_t) (sfs.f_blocks - sfs.f_bfree) * sfs.f_bsize;
+    if (inline_max >= 0)
+        info_log("%llu files inlined (%llu bytes) instead of bind mounted, tmpfs holds %llu bytes\n", "summary",
+                 (unsigned long long) stats.inlined_files, (unsigned long long) stats.inlined_bytes,
+                 (unsigned long long) stats.tmpfs_bytes);
+    if (plan_file && !replay) {
+        info_log("save plan=[%s]\n", "plan", plan_file);
+        if (!save_plan(plan_file, root, _argc - 1, key))
+            error_log("unable to save plan=[%s]\n", "error", plan_file);
+    }
+    write_index(root);
+    return true;
+}
+
+// make the detached tree mnt_fd read-only and private and attach it onto real_dir
+static bool attach_detached(int mnt_fd, const char *real_dir)
+{
+    // read-only and private for every mount of the tree at once
+    stats_phase(PHASE_REMOUNT);
+    if (mount_setattr_flags(mnt_fd, MS_RDONLY | mount_flags, MS_PRIVATE))
+        return false;
+    stats_phase(PHASE_MOVE);
+    return sys_move_mount(mnt_fd, "", AT_FDCWD, real_dir, MOVE_MOUNT_F_EMPTY_PATH) == 0;
+}
+
+// make the tree built in the workdir folder dir read-only and private and
+// move it onto real_dir
+static bool attach_tree(const char *dir, const char *real_dir)
+{
+    // remount to read-only
+    stats_phase(PHASE_REMOUNT);
+    mount(nullptr, dir, nullptr, MS_REMOUNT | MS_RDONLY | MS_REC | mount_flags, nullptr);
+    // make mount as private so we can move mounts
+    mount(nullptr, dir, nullptr, MS_PRIVATE | MS_REC, nullptr);
+    stats_phase(PHASE_MOVE);
+    return mount(dir, real_dir, nullptr, MS_MOVE, nullptr) == 0 ||
+        // recursive bind mount if moving mount does not work
+        mount(dir, real_dir, nullptr, MS_BIND | MS_REC, nullptr) == 0;
+}
+
+// -N: attach a clone of the tree mounted on real_dir at the same path in the
+// mount namespace of every target. The clones are taken here, one child
+// enters the namespaces in turn: setns needs a process that shares its fs
+// with no thread, and this one keeps its own namespace.
+static bool attach_namespaces(const char *real_dir, const char *&reason)
+{
+    if (ns_targets.empty())
+        return true;
+    std::vector<unique_fd> ns_fds, trees;
+    int failed = 0;
+    for (auto *target : ns_targets) {
+        unique_fd ns(open_mnt_ns(target));
+        unique_fd tree(ns < 0? -1 :
+            sys_open_tree(AT_FDCWD, real_dir, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE));
+        if (tree < 0) {
+            fprintf(stderr, "setns: '%s': %s\n", target, std::strerror(errno));
+            failed++;
+        }
+        ns_fds.push_back(std::move(ns));
+        trees.push_back(std::move(tree));
+    }
+    // nothing buffered is written twice
+    log_flush();
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int child_failed = 0;
+        for (size_t i = 0; i < trees.size(); i++) {
+            if (trees[i] < 0)
+                continue;
+            if (setns(ns_fds[i], CLONE_NEWNS) ||
+                sys_move_mount(trees[i], "", AT_FDCWD, real_dir, MOVE_MOUNT_F_EMPTY_PATH)) {
+                fprintf(stderr, "setns: '%s'->'%s': %s\n", ns_targets[i], real_dir, std::strerror(errno));
+                child_failed++;
+                continue;
             }
-            delete[] trusted_opaque;
+            info_log("mounted to %s in namespace of %s\n", "magic_mount", real_dir, ns_targets[i]);
         }
-        if (first) {
-        // test if this position does not exist in lower layer
-            const char *_root = strstr(src, "/");
-            if (_root == nullptr) _root = "";
-            bool last = true;
-            for (int i = layer_number + 1; i < _argc -1; i++) {
-                std::string layerdir = std::to_string(i) + _root;
-                if (lstat(layerdir.data(), &st) == 0 && S_ISDIR(st.st_mode)) {
-                    // there is folder in lower layer...
-                    last = false;
-                    break;
-                }
+        log_flush();
+        fflush(stdout);
+        _exit(child_failed);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+        failed = ns_targets.size();
+    else
+        failed += WEXITSTATUS(status);
+    if (failed > 0) {
+        reason = "Some namespaces failed";
+        return false;
+    }
+    return true;
+}
+
+// open the state file file with flags and stdio mode. Its entries tell -x
+// what to unmount, so only a regular file of root that no one else may write
+// is taken, a new one is made private.
+static FILE *open_state(const char *file, int flags, const char *mode)
+{
+    int fd = open(file, flags | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    int err = 0;
+    if (fstat(fd, &st))
+        err = errno;
+    else if (!S_ISREG(st.st_mode) || st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH)))
+        err = EPERM;
+    FILE *fp = err? nullptr : fdopen(fd, mode);
+    if (fp == nullptr) {
+        err = err? err : errno;
+        close(fd);
+        errno = err;
+    }
+    return fp;
+}
+
+// append the tree just attached onto dest to state_file, where -x finds it
+// to detach it again. A folder bound as the whole tree is stacked on the
+// tmpfs root_fd, both mount IDs are recorded then.
+static void record_tree(const char *dest, int root_fd, bool stacked)
+{
+    if (state_file == nullptr)
+        return;
+    uint64_t top, root;
+    bool unique, root_unique;
+    FILE *fp = nullptr;
+    if (get_mount_id(AT_FDCWD, dest, &top, &unique) ||
+        (stacked && get_mount_id(root_fd, "", &root, &root_unique)) ||
+        (fp = open_state(state_file, O_WRONLY | O_APPEND | O_CREAT, "a")) == nullptr ||
+        (fprintf(fp, "%d %llu %llu %s\n", unique, (unsigned long long) (stacked? root : top),
+                 (unsigned long long) top, dest) < 0) | fclose(fp))
+        error_log("unable to record tree=[%s]\n", "error", dest);
+}
+
+// detach every tree recorded in file by a lazy unmount of its root, or of
+// the root and the folder bound on it. The mount IDs make sure that it is
+// still the recorded tree, statmount finds it where it is mounted now.
+// Entries that fail stay in file.
+static bool unmount_trees(const char *file, const char *&reason)
+{
+    FILE *fp = open_state(file, O_RDONLY, "r");
+    if (fp == nullptr) {
+        reason = std::strerror(errno);
+        return false;
+    }
+    std::string keep;
+    int failed = 0;
+    char *line = nullptr;
+    size_t cap = 0;
+    while (getline(&line, &cap, fp) >= 0) {
+        int unique, pos = 0;
+        unsigned long long ids[2]; // root, top
+        if (sscanf(line, "%d %llu %llu %n", &unique, &ids[0], &ids[1], &pos) != 3 || pos == 0) {
+            keep += line;
+            failed++;
+            continue;
+        }
+        std::string dest(line + pos, strcspn(line + pos, "\n"));
+        std::string where = dest;
+        if (unique && get_mount_point(ids[0], where)) {
+            if (errno == ENOENT) {
+                info_log("%s is gone already\n", "unmount", dest.data());
+                continue;
             }
-            if (last) {
-                // marked as unmerged folder to reduce wasting magic mount
-                verbose_log("%s marked as unmerged folder\n", "magic_mount", target);
-                s->ignore = true;
-                return mount(src, target, nullptr, MS_BIND | mount_flags, nullptr) == 0;
+            // no statmount, only the recorded place is checked
+            where = dest;
+        }
+        const char *err = nullptr;
+        for (int i = (ids[0] != ids[1])? 1 : 0; i >= 0 && err == nullptr; i--) {
+            uint64_t cur;
+            bool cur_unique;
+            if (get_mount_id(AT_FDCWD, where.data(), &cur, &cur_unique) ||
+                cur != ids[i] || cur_unique != (bool) unique)
+                err = "Not the recorded tree or covered by another mount";
+            else if (umount2(where.data(), MNT_DETACH | UMOUNT_NOFOLLOW))
+                err = std::strerror(errno);
+            else
+                info_log("detached mount %llu from %s\n", "unmount", ids[i], where.data());
+        }
+        if (err == nullptr)
+            continue;
+        fprintf(stderr, "umount: '%s': %s\n", dest.data(), err);
+        keep += line;
+        failed++;
+    }
+    free(line);
+    fclose(fp);
+    if (keep.empty()) {
+        unlink(file);
+    } else if ((fp = open_state(file, O_WRONLY | O_TRUNC, "w")) != nullptr) {
+        fputs(keep.data(), fp);
+        fclose(fp);
+    }
+    if (failed > 0) {
+        reason = "Some trees failed";
+        return false;
+    }
+    return true;
+}
+
+// build the merged tree as a detached mount, without workdir, and attach it in one step
+static bool magic_mount_detached(const char *mnt_name, const char *real_dir, const char *&reason)
+{
+    detached_tree = true;
+    info_log("detached tree\n", "setup");
+    stats_phase(PHASE_BIND_LAYERS);
+    layer_fds.assign(_argc - 1, -1);
+    for (int i=1; i < _argc-1; i++) {
+        info_log("layerdir[%d]=[%s]\n", "setup", i, _argv[i]);
+        if ((layer_fds[i] = open(_argv[i], O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+            reason = std::strerror(errno);
+            return false;
+        }
+    }
+    info_log("magic mount layerdir[0]=[%s]\n", "setup", real_dir);
+    unique_fd mnt_fd(overlay_layers());
+    if (mnt_fd < 0) {
+        stats_phase(PHASE_WORKDIR);
+        mnt_fd.reset(fsmount_tmpfs(mnt_name));
+        if (mnt_fd < 0) {
+            reason = std::strerror(errno);
+            return false;
+        }
+        layer_fds[0] = mnt_fd;
+        if (!magic_mount_layers(mnt_name, reason)) {
+            error_log("mount failed\n", "magic_mount");
+            return false;
+        }
+    }
+    if (!attach_detached(mnt_fd, real_dir)) {
+        reason = std::strerror(errno);
+        return false;
+    }
+    record_tree(real_dir, mnt_fd, root_bound);
+    info_log("mounted to %s\n", "magic_mount", real_dir);
+    return true;
+}
+
+// remove the entry name under dirfd from the mounted tree, with whatever is
+// bound on or below it
+static bool remove_node(int dirfd, const char *name)
+{
+    STAT_ADD(syscalls, 2);
+    // fails with EINVAL where nothing is bound
+    umount2(at_path(dirfd, name).data(), MNT_DETACH | UMOUNT_NOFOLLOW);
+    if (unlinkat(dirfd, name, 0) == 0)
+        return true;
+    if (errno != EISDIR)
+        return false;
+    STAT_INC(syscalls);
+    unique_fd fd(openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+    std::vector<char> dents;
+    if (fd < 0 || !read_dents(fd, dents))
+        return false;
+    for_each_dent(dp, dents) {
+        if (strcmp(dp->d_name, ".") == 0 ||
+            strcmp(dp->d_name, "..") == 0)
+            continue;
+        if (!remove_node(fd, dp->d_name))
+            return false;
+    }
+    STAT_INC(syscalls);
+    return unlinkat(dirfd, name, AT_REMOVEDIR) == 0;
+}
+
+// whether old, mounted under live_fd, is what node would mount now. Bound
+// entries are compared by inode, inlined files by what inline_file copied.
+static bool same_node(const item_node &old, const item_node &node, int src_dirfd, int live_fd, dev_t tmpfs_dev)
+{
+    int mode = node.get_mode();
+    if (old.layer != node.layer || old.get_mode() != mode || old.bind_dir != node.bind_dir)
+        return false;
+    const char *name = node.name();
+    switch (mode) {
+    case 0:
+    case 1:
+    case 2: {
+        struct stat live, src;
+        STAT_ADD(syscalls, 2);
+        if (fstatat(live_fd, name, &live, AT_SYMLINK_NOFOLLOW) ||
+            fstatat(src_dirfd, name, &src, AT_SYMLINK_NOFOLLOW))
+            return false;
+        if (mode == 1 && inline_max >= 0 && src.st_size <= inline_max)
+            return live.st_dev == tmpfs_dev && live.st_size == src.st_size &&
+                live.st_mode == src.st_mode && live.st_uid == src.st_uid && live.st_gid == src.st_gid &&
+                live.st_mtim.tv_sec == src.st_mtim.tv_sec && live.st_mtim.tv_nsec == src.st_mtim.tv_nsec;
+        return live.st_dev == src.st_dev && live.st_ino == src.st_ino;
+    }
+    case 3: {
+        char a[PATH_MAX], b[PATH_MAX];
+        STAT_ADD(syscalls, 2);
+        ssize_t n = readlinkat(live_fd, name, a, sizeof(a));
+        return n >= 0 && readlinkat(src_dirfd, name, b, sizeof(b)) == n && memcmp(a, b, n) == 0;
+    }
+    case 4:
+    case 5:
+        return old.st_rdev == node.st_rdev && old.st_mode == node.st_mode &&
+            old.st_uid == node.st_uid && old.st_gid == node.st_gid && old.con == node.con;
+    }
+    return true;
+}
+
+struct update_count
+{
+    int kept = 0;
+    int removed = 0;
+    int added = 0;
+};
+
+// patch the merged folder old, mounted at live_fd, into node. Folders merged
+// in both are patched recursively, other entries stay if they are unchanged
+// or are removed and mounted again.
+static bool update_dir(const item_node &old, item_node &node, const std::vector<int> &src_fds,
+                       int live_fd, dev_t tmpfs_dev, update_count &cnt)
+{
+    if (old.st_mode != node.st_mode || old.st_uid != node.st_uid ||
+        old.st_gid != node.st_gid || old.con != node.con) {
+        verbose_log("0%s <- %d%s\n", "attr", node.path().data(), node.layer, node.path().data());
+        if (set_attr(live_fd, node.st_mode, node.st_uid, node.st_gid, node.con, false, nullptr))
+            return false;
+    }
+    const char *name = node.name();
+    std::vector<int> fds(src_fds.size(), -1);
+    bool ret = true;
+    STAT_ADD(syscalls, node.layers.size());
+    for (int layer : node.layers) {
+        if ((fds[layer] = openat(src_fds[layer], name, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+            ret = false;
+            break;
+        }
+    }
+    std::unordered_map<std::string_view, const item_node *> prev;
+    for (auto *child : old.children)
+        prev.emplace(child->name(), child);
+    for (size_t i = 0; ret && i < node.children.size(); i++) {
+        item_node &child = *node.children[i];
+        const item_node *o = nullptr;
+        auto it = prev.find(child.name());
+        if (it != prev.end()) {
+            o = it->second;
+            prev.erase(it);
+        }
+        if (o && o->get_mode() == 0 && child.get_mode() == 0 && !o->bind_dir && !child.bind_dir) {
+            STAT_INC(syscalls);
+            unique_fd fd(openat(live_fd, child.name(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+            ret = fd >= 0 && update_dir(*o, child, fds, fd, tmpfs_dev, cnt);
+            continue;
+        }
+        if (o && same_node(*o, child, fds[child.layer], live_fd, tmpfs_dev)) {
+            cnt.kept++;
+            continue;
+        }
+        if (o && o->get_mode() != -1) {
+            verbose_log("0%s\n", "remove", o->path().data());
+            cnt.removed++;
+            if (!(ret = remove_node(live_fd, o->name())))
+                break;
+        }
+        if (child.get_mode() != -1)
+            cnt.added++;
+        mount_prep prep;
+        ret = magic_mount(child, fds, live_fd, node.con, prep);
+    }
+    // entries no layer provides any more
+    for (auto it = prev.begin(); ret && it != prev.end(); ++it) {
+        if (it->second->get_mode() == -1)
+            continue;
+        verbose_log("0%s\n", "remove", it->second->path().data());
+        cnt.removed++;
+        ret = remove_node(live_fd, it->second->name());
+    }
+    for (int fd : fds)
+        if (fd >= 0) close(fd);
+    return ret;
+}
+
+// patch the tree an earlier run with the same plan file mounted on real_dir
+// into what the layers merge to now, in place
+static bool magic_mount_update(const char *real_dir, const char *&reason)
+{
+    info_log("update tree\n", "setup");
+    stats_phase(PHASE_BIND_LAYERS);
+    layer_fds.assign(_argc - 1, -1);
+    // opened for reading, attributes of the merged folders may change
+    layer_fds[0] = open(real_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (int i=1; i < _argc-1; i++) {
+        info_log("layerdir[%d]=[%s]\n", "setup", i, _argv[i]);
+        layer_fds[i] = open(_argv[i], O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (std::find(layer_fds.begin(), layer_fds.end(), -1) != layer_fds.end()) {
+        reason = std::strerror(errno);
+        return false;
+    }
+    struct statfs sfs;
+    struct stat root_st;
+    if (fstatfs(layer_fds[0], &sfs) || sfs.f_type != TMPFS_MAGIC || fstat(layer_fds[0], &root_st)) {
+        reason = "Not a merged tree";
+        return false;
+    }
+    stats_phase(PHASE_DISCOVERY);
+    item_node old, root;
+    uint64_t key = plan_key(layer_fds, _argv, full_magic_mount | dedupe_files << 1);
+    if (!load_plan(plan_file, old, _argc - 1, key, false)) {
+        reason = "No plan of the mounted tree";
+        return false;
+    }
+    if (!scan_layers(root)) {
+        reason = "Unable to scan layers";
+        return false;
+    }
+    if (old.bind_dir || root.bind_dir) {
+        reason = "Tree is a single bind mount";
+        return false;
+    }
+    // writable only while it is patched
+    stats_phase(PHASE_MATERIALIZE);
+    if (mount(nullptr, real_dir, nullptr, MS_REMOUNT | mount_flags, nullptr)) {
+        reason = std::strerror(errno);
+        return false;
+    }
+    update_count cnt;
+    bool ret = update_dir(old, root, layer_fds, layer_fds[0], root_st.st_dev, cnt);
+    stats_phase(PHASE_REMOUNT);
+    mount(nullptr, real_dir, nullptr, MS_REMOUNT | MS_RDONLY | mount_flags, nullptr);
+    // binds the patch added are writable, the remount only covers the root
+    STAT_INC(syscalls);
+    if (mount_setattr_flags(layer_fds[0], MS_RDONLY | mount_flags, 0) && errno != ENOSYS) {
+        error_log("unable to make the tree read-only: %s\n", "update", std::strerror(errno));
+        ret = false;
+    }
+    mount(nullptr, real_dir, nullptr, MS_PRIVATE | MS_REC, nullptr);
+    if (!ret) {
+        // the tree matches neither plan now
+        unlink(plan_file);
+        reason = "Update failed, mount the tree again";
+        return false;
+    }
+    info_log("%d entries kept, %d removed, %d added\n", "update", cnt.kept, cnt.removed, cnt.added);
+    info_log("save plan=[%s]\n", "plan", plan_file);
+    if (!save_plan(plan_file, root, _argc - 1, key))
+        error_log("unable to save plan=[%s]\n", "error", plan_file);
+    write_index(root);
+    return true;
+}
+
+// bind the layer src privately onto the workdir folder dir
+static bool bind_layer(const char *src, const char *dir)
+{
+    mkdir(dir, 0755);
+    return mount(src, dir, nullptr, MS_BIND | mount_flags, nullptr) == 0 &&
+        mount("", dir, nullptr, MS_PRIVATE | mount_flags, nullptr) == 0;
+}
+
+// one line of a job file: NAME [-r] [-o MNTFLAGS] SRC... DEST
+struct mount_job
+{
+    std::string name;        // source of the tmpfs
+    int flags = 0;           // mount flags on top of the global ones
+    std::vector<int> layers; // indexes in the shared layer list, top first
+    std::string dest;
+    item_node *tree = nullptr; // merged tree, shared by jobs with the same layers
+};
+
+// read the jobs of file, layers receives every distinct SRC once. Paths are
+// resolved here, before the workdir becomes the cwd. Bad lines are reported
+// and skipped, returns their number or -1 if file cannot be read or is no
+// regular file.
+static int parse_jobs(const char *file, std::vector<mount_job> &jobs, std::vector<std::string> &layers)
+{
+    FILE *fp = fopen(file, "re");
+    if (fp == nullptr)
+        return -1;
+    // a folder reads as an empty file
+    struct stat st;
+    int err = 0;
+    if (fstat(fileno(fp), &st))
+        err = errno;
+    else if (!S_ISREG(st.st_mode))
+        err = S_ISDIR(st.st_mode)? EISDIR : EINVAL;
+    if (err) {
+        fclose(fp);
+        errno = err;
+        return -1;
+    }
+    std::map<std::string, int> index;
+    int failed = 0;
+    char *line = nullptr;
+    size_t cap = 0;
+    for (int lineno = 1; getline(&line, &cap, fp) >= 0; lineno++) {
+        for (char *p = line; *p; p++)
+            if (*p == '\t' || *p == '\n')
+                *p = ' ';
+        auto args = split_ro(line, ' ');
+        if (args.empty() || args[0][0] == '#')
+            continue;
+        mount_job job;
+        job.name = args[0];
+        size_t i = 1;
+        for (; i < args.size() && args[i][0] == '-'; i++) {
+            if (args[i] == "-r")
+                job.flags |= MS_REC;
+            else if (args[i] == "-o" && i + 1 < args.size())
+                job.flags |= parse_mount_flags(args[++i].data());
+            else
+                break;
+        }
+        if (i >= args.size() || args[i][0] == '-' || args.size() - i < 2) {
+            fprintf(stderr, "%s:%d: expected NAME [-r] [-o MNTFLAGS] SRC... DEST\n", file, lineno);
+            failed++;
+            continue;
+        }
+        // resolved DEST and SRC..., the first unusable one fails the line
+        std::vector<std::string> paths;
+        for (size_t j = args.size(); j-- > i;) {
+            char *path = realpath(args[j].data(), nullptr);
+            if (path == nullptr || strcmp(path, "/") == 0 || !is_dir(path, true)) {
+                fprintf(stderr, "%s:%d: '%s': %s\n", file, lineno, args[j].data(),
+                        path? "Invalid arguments" : std::strerror(errno));
+                free(path);
+                break;
             }
+            paths.emplace_back(path);
+            free(path);
+        }
+        if (paths.size() != args.size() - i) {
+            failed++;
+            continue;
+        }
+        job.dest = paths[0];
+        for (size_t j = paths.size(); j-- > 1;) {
+            auto it = index.emplace(paths[j], layers.size());
+            if (it.second)
+                layers.push_back(paths[j]);
+            job.layers.push_back(it.first->second);
+        }
+        jobs.push_back(std::move(job));
+    }
+    free(line);
+    fclose(fp);
+    return failed;
+}
+
+// mount the tree of job, the k-th one, from the shared layers in fds and
+// attach it onto its destination
+static bool mount_job_tree(const mount_job &job, size_t k, const std::vector<int> &fds)
+{
+    std::vector<int> src_fds(1, -1);
+    for (int layer : job.layers)
+        src_fds.push_back(fds[layer]);
+    stats_phase(PHASE_WORKDIR);
+    if (detached_tree) {
+        unique_fd mnt_fd(fsmount_tmpfs(job.name.data()));
+        if (mnt_fd < 0)
+            return false;
+        src_fds[0] = mnt_fd;
+        stats_phase(PHASE_MATERIALIZE);
+        mount_prep prep;
+        if (!magic_mount(*job.tree, src_fds, mnt_fd, nullptr, prep) || !attach_detached(mnt_fd, job.dest.data()))
+            return false;
+        record_tree(job.dest.data(), mnt_fd, job.tree->bind_dir || job.tree->overlay > 0);
+        return true;
+    }
+    std::string dir = "j" + std::to_string(k);
+    if (mkdir(dir.data(), 0755) || mount(job.name.data(), dir.data(), "tmpfs", 0, nullptr))
+        return false;
+    unique_fd fd(open(dir.data(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+    if (fd < 0)
+        return false;
+    src_fds[0] = fd;
+    stats_phase(PHASE_MATERIALIZE);
+    mount_prep prep;
+    if (!magic_mount(*job.tree, src_fds, fd, nullptr, prep) || !attach_tree(dir.data(), job.dest.data()))
+        return false;
+    record_tree(job.dest.data(), -1, false);
+    return true;
+}
+
+// run all jobs in one go. Every layer is bound (or opened in detached mode)
+// once for all jobs, jobs with the same layers share one scan and the scans
+// of all jobs run together on one thread pool. The trees are then mounted
+// and attached one job after the other. failed counts the bad lines already.
+static bool run_jobs(std::vector<mount_job> &jobs, const std::vector<std::string> &layers, int failed,
+                     const char *&reason)
+{
+    stats_phase(PHASE_BIND_LAYERS);
+    std::vector<int> fds(layers.size(), -1);
+    for (size_t i = 0; i < layers.size(); i++) {
+        const char *src = layers[i].data();
+        std::string dir = std::to_string(i + 1);
+        info_log("layerdir[%zu]=[%s]\n", "setup", i + 1, src);
+        if (!is_supported_fs(src)) {
+            reason = "Unsupported layer";
+            return false;
+        }
+        if ((!detached_tree && !bind_layer(src, dir.data())) ||
+            (fds[i] = open(detached_tree? src : dir.data(), O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+            reason = std::strerror(errno);
+            return false;
         }
     }
-    struct dirent *dp;
-    DIR *dirfp = opendir(src);
-    if (dirfp != nullptr)
+
+    stats_phase(PHASE_DISCOVERY);
+    std::map<std::vector<int>, item_node> trees;
     {
-        while ((dp = readdir(dirfp)) != nullptr)
-        {
-            if (strcmp(dp->d_name, ".") == 0 ||
-                strcmp(dp->d_name, "..") == 0)
+        thread_pool pool(scan_threads);
+        for (auto &job : jobs) {
+            auto it = trees.find(job.layers);
+            if (it != trees.end()) {
+                job.tree = &it->second;
                 continue;
-            char b1[PATH_MAX], b2[PATH_MAX];
-            snprintf(b1, sizeof(b1), "%s/%s", src, dp->d_name);
-            snprintf(b2, sizeof(b2), "%s/%s", target, dp->d_name);
-            if (!magic_mount(b1, b2, layer_number))
-                return false;
+            }
+            job.tree = &trees[job.layers];
+            std::vector<int> src_fds(1, -1);
+            for (int layer : job.layers)
+                src_fds.push_back(fds[layer]);
+            if (!scan_start(pool, *job.tree, src_fds))
+                fail_scan(job.dest, errno);
         }
-        closedir(dirfp);
-        return true;
+        pool.wait();
     }
-    return false;
+    if (scan_failed) {
+        reason = std::strerror(scan_errno);
+        return false;
+    }
+    if (dedupe_files && !full_magic_mount) {
+        for (auto &tree : trees) {
+            std::vector<int> src_fds(1, -1);
+            for (int layer : tree.first)
+                src_fds.push_back(fds[layer]);
+            if (tree.second.layer != 0)
+                collapse(tree.second, src_fds);
+        }
+    }
+    info_log("%zu jobs, %zu layers, %zu scans\n", "jobs", jobs.size(), layers.size(), trees.size());
+
+    int flags = mount_flags;
+    for (size_t k = 0; k < jobs.size(); k++) {
+        auto &job = jobs[k];
+        mount_flags = flags | job.flags;
+        info_log("job [%s] -> %s\n", "jobs", job.name.data(), job.dest.data());
+        errno = EINVAL;
+        if (job.tree->layer == 0 || !mount_job_tree(job, k, fds)) {
+            fprintf(stderr, "mount: '%s'->'%s': %s\n", job.name.data(), job.dest.data(), std::strerror(errno));
+            failed++;
+            continue;
+        }
+        info_log("mounted to %s\n", "magic_mount", job.dest.data());
+    }
+    mount_flags = flags;
+    if (failed > 0) {
+        reason = "Some jobs failed";
+        return false;
+    }
+    return true;
+}
+
+// path relative to the cwd at start, the workdir becomes the cwd later
+static const char *abs_path(const char *path)
+{
+    char cwd[PATH_MAX];
+    if (path[0] == '/' || getcwd(cwd, sizeof(cwd)) == nullptr)
+        return path;
+    return strdup((std::string(cwd) + "/" + path).data());
 }
+
 int main(int argc, char **argv)
 {
     const char *mnt_name = "tmpfs";
     const char *reason = "Invalid arguments";
     const char *real_dir = nullptr;
     bool mount_file_as_tmpfs = false;
+    const char *manifest = nullptr;
+    const char *job_file = nullptr;
+    const char *unmount_file = nullptr;
+    const char *query_file = nullptr;
+    std::vector<mount_job> jobs;
+    std::vector<std::string> job_layers;
+    int job_failed = 0;
 
     first:
-    if (argc < 3) {
+    if (argc < 3 && !((manifest || job_file || unmount_file) && argc == 1) && !(query_file && argc == 2)) {
         fprintf(stderr, "usage: %s [OPTION] SRC... DEST\n\n"
                         "Use magic mount to combine SRC... and mount into DIR\n\n"
                         "-r            Recursive magic mount mountpoint under DIR1, DIR2... also\n"
                         "-n NAME       Give magic mount a nice name\n"
                         "-v [-/FILE]   Verbose magic mount to stdout [-] or file\n"
+                        "-l LEVEL      Log only debug, info, warn or error records and above\n"
                         "-a            Always use magic mount for any case\n"
+                        "-O            Merge with overlayfs where the kernel can, magic mount elsewhere\n"
+                        "-d            Serve files the same as in a lower layer from there, bind folders left to one layer whole\n"
                         "-b            Clone file SRC into tmpfs and bind mount to DEST, max 2 arguments\n"
+                        "-m MANIFEST   Like -b for every \"SRC DEST\" line of MANIFEST, in one tmpfs\n"
+                        "-J JOBFILE    Mount every \"NAME [-r] [-o MNTFLAGS] SRC... DEST\" line of JOBFILE in one run\n"
                         "-o [MNTFLAGS] Mount flags\n"
+                        "-j THREADS    Scan layers and build the merged tree with THREADS threads, default is number of CPUs\n"
+                        "-p FILE       Save the merge plan to FILE, replay it while its folders are unchanged\n"
+                        "-U            Patch the tree mounted on DEST with -p FILE to the current SRC... in place\n"
+                        "-i SIZE       Copy files up to SIZE bytes (K/M suffix) into tmpfs instead of bind mounting them\n"
+                        "-u            Batch file system operations with io_uring if the kernel allows\n"
+                        "-t FILE       Record the mount ID of every mounted tree in FILE\n"
+                        "-x FILE       Detach every tree recorded in FILE, one unmount each\n"
+                        "-N NS         Attach the tree at DEST in the mount namespace NS as well, a pid or\n"
+                        "              namespace file, one clone of the tree each, repeatable\n"
+                        "-P FILE       Write an index of the layer serving every path of the tree to FILE\n"
+                        "-q INDEX      Print the layer serving each PATH... of the tree of INDEX, in place of SRC... DEST\n"
+                        "-s [-/FILE]   Report phase timings and operation counts as JSON to stderr [-] or FILE\n"
                         "\n", basename(argv[0]));
         return 1;
     }
 
-    if (argv[1][0] == '-') {
+    if (argc > 1 && argv[1][0] == '-') {
         char *argv_option = argv[1];
         for (int i = 1; argv_option[i] != '\0'; ++i) {
             if (argv_option[i] == 'r') {
-                verbose_log("recursive\n", "option");
+                info_log("recursive\n", "option");
                 mount_flags |= MS_REC;
             } else if (argv_option[i] == 'n' && argv_option[i+1] == '\0') {
-                verbose_log("name=[%s]\n", "option", argv[2]);
+                info_log("name=[%s]\n", "option", argv[2]);
                 mnt_name = argv[2];
                 argc--; argv++;
                 break;
@@ -252,49 +1961,107 @@ int main(int argc, char **argv)
                 } else {
                     if (log_fd >= 0)
                         break;
-                    verbose_log("log to file=[%s]\n", "option", argv[2]);
+                    info_log("log to file=[%s]\n", "option", argv[2]);
                     log_fd = open(argv[2], O_RDWR | O_CREAT | O_APPEND, 0666);
                 }
                 argc--; argv++;
                 break;
+            } else if (argv_option[i] == 'l' && argv_option[i+1] == '\0') {
+                static const char *levels[] = { "debug", "info", "warn", "error" };
+                auto it = std::find_if(std::begin(levels), std::end(levels),
+                                       [&](const char *l) { return strcmp(l, argv[2]) == 0; });
+                if (it == std::end(levels)) {
+                    fprintf(stderr, "Invalid log level: [%s]\n", argv[2]);
+                    return 1;
+                }
+                log_level = it - std::begin(levels);
+                argc--; argv++;
+                break;
             } else if (argv_option[i] == 'o' && argv_option[i+1] == '\0') {
-                std::string mnt_opts = argv[2];
-                auto opts = split_ro(mnt_opts, ',');
-                for (auto &s : opts) {
-                        if (s == "nosuid") {
-                            mount_flags |= MS_NOSUID;
-                        } else if (s == "lazytime") {
-                            mount_flags |= MS_LAZYTIME;
-                        } else if (s == "nodev") {
-                            mount_flags |= MS_NODEV;
-                        } else if (s == "noexec") {
-                            mount_flags |= MS_NOEXEC;
-                        } else if (s == "sync") {
-                            mount_flags |= MS_SYNCHRONOUS;
-                        } else if (s == "dirsync") {
-                            mount_flags |= MS_DIRSYNC;
-                        } else if (s == "noatime") {
-                            mount_flags |= MS_NOATIME;
-                        } else if (s == "nodiratime") {
-                            mount_flags |= MS_NODIRATIME;
-                        } else if (s == "relatime") {
-                            mount_flags |= MS_RELATIME;
-                        } else if (s == "strictatime") {
-                            mount_flags |= MS_STRICTATIME;
-                        } else if (s == "lazytime") {
-                            mount_flags |= MS_LAZYTIME;
-                        } else if (s == "nosymfollow") {
-                            mount_flags |= MS_NOSYMFOLLOW;
-                        } else if (s == "mand") {
-                            mount_flags |= MS_MANDLOCK;
-                        } else if (s == "silent") {
-                            mount_flags |= MS_SILENT;
-                        }
+                mount_flags |= parse_mount_flags(argv[2]);
+                argc--; argv++;
+                break;
+            } else if (argv_option[i] == 'j' && argv_option[i+1] == '\0') {
+                scan_threads = atoi(argv[2]);
+                info_log("threads=[%d]\n", "option", scan_threads);
+                argc--; argv++;
+                break;
+            } else if (argv_option[i] == 'm' && argv_option[i+1] == '\0') {
+                manifest = argv[2];
+                mount_file_as_tmpfs = true;
+                info_log("manifest=[%s]\n", "option", manifest);
+                argc--; argv++;
+                break;
+            } else if (argv_option[i] == 't' && argv_option[i+1] == '\0') {
+                state_file = abs_path(argv[2]);
+                info_log("state=[%s]\n", "option", state_file);
+                argc--; argv++;
+                break;
+            } else if (argv_option[i] == 'x' && argv_option[i+1] == '\0') {
+                unmount_file = argv[2];
+                info_log("unmount=[%s]\n", "option", unmount_file);
+                argc--; argv++;
+                break;
+            } else if (argv_option[i] == 'N' && argv_option[i+1] == '\0') {
+                // a namespace file relative to the cwd at start, not a pid
+                ns_targets.push_back(argv[2][strspn(argv[2], "0123456789")]? abs_path(argv[2]) : argv[2]);
+                info_log("namespace=[%s]\n", "option", argv[2]);
+                argc--; argv++;
+                break;
+            } else if (argv_option[i] == 'P' && argv_option[i+1] == '\0') {
+                index_file = abs_path(argv[2]);
+                info_log("index=[%s]\n", "option", index_file);
+                argc--; argv++;
+                break;
+            } else if (argv_option[i] == 'q' && argv_option[i+1] == '\0') {
+                query_file = argv[2];
+                argc--; argv++;
+                break;
+            } else if (argv_option[i] == 'J' && argv_option[i+1] == '\0') {
+                job_file = argv[2];
+                info_log("jobs=[%s]\n", "option", job_file);
+                argc--; argv++;
+                break;
+            } else if (argv_option[i] == 'i' && argv_option[i+1] == '\0') {
+                char *end;
+                errno = 0;
+                inline_max = strtoll(argv[2], &end, 10);
+                bool bad = end == argv[2];
+                int shift = 0;
+                if (*end == 'K' || *end == 'k')
+                    shift = 10, end++;
+                else if (*end == 'M' || *end == 'm')
+                    shift = 20, end++;
+                if (bad || *end != '\0' || errno || inline_max < 0 ||
+                    inline_max > (LLONG_MAX >> shift)) {
+                    fprintf(stderr, "Invalid size: [%s]\n", argv[2]);
+                    return 1;
                 }
+                inline_max <<= shift;
+                info_log("inline files up to %lld bytes\n", "option", inline_max);
+                argc--; argv++;
+                break;
+            } else if (argv_option[i] == 's' && argv_option[i+1] == '\0') {
+                // - is stderr
+                stats_file = strcmp(argv[2], "-")? abs_path(argv[2]) : argv[2];
+                info_log("stats=[%s]\n", "option", stats_file);
+                argc--; argv++;
+                break;
+            } else if (argv_option[i] == 'p' && argv_option[i+1] == '\0') {
+                plan_file = abs_path(argv[2]);
+                info_log("plan=[%s]\n", "option", plan_file);
                 argc--; argv++;
                 break;
             } else if (argv_option[i] == 'a') {
                 full_magic_mount = true;
+            } else if (argv_option[i] == 'u') {
+                use_io_uring = true;
+            } else if (argv_option[i] == 'U') {
+                update_tree = true;
+            } else if (argv_option[i] == 'O') {
+                use_overlay = true;
+            } else if (argv_option[i] == 'd') {
+                dedupe_files = true;
             } else if (argv_option[i] == 'b') {
                 mount_file_as_tmpfs = true;
             } else {
@@ -306,7 +2073,55 @@ int main(int argc, char **argv)
         goto first;
     }
 
-    if (mount_file_as_tmpfs) {
+    // records are not even formatted without a place to log to
+    if (log_fd < 0 && !verbose_logging)
+        log_level = LOG_LEVEL_NONE;
+
+    if (query_file) {
+        int missing = lookup_index(query_file, argv + 1, argc - 1);
+        if (missing < 0)
+            fprintf(stderr, "index: '%s': %s\n", query_file, std::strerror(errno));
+        return missing != 0;
+    }
+
+    if (update_tree && (plan_file == nullptr || mount_file_as_tmpfs)) {
+        fprintf(stderr, "-U needs the -p FILE of the mounted tree\n");
+        return 1;
+    }
+    if (!ns_targets.empty() && (update_tree || mount_file_as_tmpfs || job_file || unmount_file)) {
+        fprintf(stderr, "-N only attaches a tree mounted from SRC... DEST\n");
+        return 1;
+    }
+    if (update_tree && use_overlay) {
+        fprintf(stderr, "-U cannot patch folders merged by overlayfs, mount again without -O\n");
+        return 1;
+    }
+    if (strcmp(mnt_name, "tmpfs") != 0)
+        overlay_name = mnt_name;
+
+    if (unmount_file) {
+        if (argc != 1) {
+            fprintf(stderr, "mount: '%s': %s\n", unmount_file, reason);
+            return -1;
+        }
+        real_dir = unmount_file;
+    } else if (manifest) {
+        if (argc != 1) {
+            fprintf(stderr, "mount: '%s': %s\n", manifest, reason);
+            return -1;
+        }
+        real_dir = manifest;
+    } else if (job_file) {
+        if (argc != 1 || plan_file || index_file || mount_file_as_tmpfs) {
+            fprintf(stderr, "mount: '%s': %s\n", job_file, reason);
+            return -1;
+        }
+        real_dir = job_file;
+        if ((job_failed = parse_jobs(job_file, jobs, job_layers)) < 0) {
+            fprintf(stderr, "mount: '%s': %s\n", job_file, std::strerror(errno));
+            return -1;
+        }
+    } else if (mount_file_as_tmpfs) {
 		if (argc > 3 || !is_regfile(argv[argc-1], true) || !is_regfile(argv[argc-2], true)) {
             fprintf(stderr, "mount: '%s'->'%s': %s\n", mnt_name, argv[argc-1], reason);
             return -1;
@@ -316,92 +2131,172 @@ int main(int argc, char **argv)
         return -1;
     }
 
+    if (index_file && !mount_file_as_tmpfs && !job_file && !unmount_file) {
+        // resolved before the workdir becomes the cwd
+        index_layers.emplace_back(real_dir);
+        for (int i=1; i < argc-1; i++) {
+            char *path = realpath(argv[i], nullptr);
+            index_layers.emplace_back(path? path : argv[i]);
+            free(path);
+        }
+    }
+
     std::string tmp;
     int tmp_fd = -1;
+    const char *mode = "legacy";
+    _argv = argv;
+    _argc = argc;
+    if (scan_threads <= 0)
+        scan_threads = std::min(sysconf(_SC_NPROCESSORS_ONLN), 8L);
+    {
+        // every scanning thread keeps a few folders per layer open
+        struct rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rl);
+        }
+    }
+    if (use_io_uring && !io_batch::enable())
+        warn_log("io_uring unavailable, using plain syscalls\n", "setup");
+    if (unmount_file) {
+        mode = "unmount";
+        stats_phase(PHASE_CLEANUP);
+        if (!unmount_trees(unmount_file, reason))
+            goto failed;
+        goto success;
+    }
+    if (!mount_file_as_tmpfs) {
+        for (int i=1; i < argc-1; i++) {
+            if (!is_supported_fs(argv[i])) {
+                goto failed;
+             }
+        }
+        if (update_tree) {
+            mode = "update";
+            if (!magic_mount_update(real_dir, reason))
+                goto failed;
+            goto success;
+        }
+        stats_phase(PHASE_WORKDIR);
+        if (can_mount_detached()) {
+            if (job_file) {
+                mode = "jobs";
+                detached_tree = true;
+                if (!run_jobs(jobs, job_layers, job_failed, reason))
+                    goto failed;
+                goto success;
+            }
+            mode = "detached";
+            if (!magic_mount_detached(mnt_name, real_dir, reason) || !attach_namespaces(real_dir, reason))
+                goto failed;
+            goto success;
+        }
+    }
+    stats_phase(PHASE_WORKDIR);
     do {
         tmp = "/dev/.workdir_";
         tmp += random_strc(20);
     } while (access(tmp.data(), F_OK) == 0);
-    verbose_log("workdir=[%s]\n", "setup", tmp.data());
+    info_log("workdir=[%s]\n", "setup", tmp.data());
     if (mkdir(tmp.data(), 0755) ||
         mount("tmpfs", tmp.data(), "tmpfs", 0, nullptr) ||
-        chdir(tmp.data())) {
-        verbose_log("unable to setup workdir=[%s]\n", "error", tmp.data());
+        // file clones keep the cwd for relative SRC and DEST
+        (!mount_file_as_tmpfs && chdir(tmp.data()))) {
+        error_log("unable to setup workdir=[%s]\n", "error", tmp.data());
         reason = "Unable to create working directory";
         goto failed;
     }
     tmp_fd = open(tmp.data(), O_PATH);
+    if (job_file) {
+        mode = "jobs";
+        if (!run_jobs(jobs, job_layers, job_failed, reason))
+            goto failed;
+        goto success;
+    }
+    if (manifest) {
+        mode = "manifest";
+        int ret = clone_manifest(manifest, tmp.data());
+        if (ret < 0) {
+            reason = std::strerror(errno);
+            goto failed;
+        }
+        if (ret > 0) {
+            reason = "Some entries failed";
+            goto failed;
+        }
+        goto success;
+    }
     if (mount_file_as_tmpfs) {
+        mode = "file";
+        stats_phase(PHASE_MATERIALIZE);
         auto tmpfile = tmp + "/file";
-        int in_fd = open(argv[1], O_RDONLY | O_NOATIME);
-        int out_fd = open(tmpfile.data(), O_RDWR | O_CREAT, 0666);
-        struct stat st{};
-        if (stat(argv[1], &st) || in_fd < 0 || out_fd < 0 || sendfile(out_fd, in_fd, nullptr, st.st_size) < 0 ||
-            clone_attr(argv[1], tmpfile.data()) ||
+        if (!clone_file(argv[1], tmpfile.data()) ||
             mount(tmpfile.data(), argv[2], nullptr, MS_BIND, nullptr)) 
             goto failed;
+        stats_phase(PHASE_REMOUNT);
         mount(nullptr, argv[2], nullptr, MS_REMOUNT | mount_flags, nullptr);
         goto success;
     }
 
-    for (int i=1; i < argc-1; i++) {
-        if (!is_supported_fs(argv[i])) {
-            goto failed;
-         }
-    }
     // setup workdir first
-    _argv = argv;
-    _argc = argc;
     {
+        stats_phase(PHASE_BIND_LAYERS);
         mkdir("0", 0755);
         for (int i=1; i < argc-1; i++) {
             char workdir[12];
             snprintf(workdir, sizeof(workdir), "%d", i);
-            mkdir(workdir, 0755);
-            verbose_log("layerdir[%d]=[%s]\n", "setup", i, argv[i]);
-            if (!mount(argv[i], workdir, nullptr, MS_BIND | mount_flags, nullptr) &&
-                !mount("", workdir, nullptr, MS_PRIVATE | mount_flags, nullptr)) {
+            info_log("layerdir[%d]=[%s]\n", "setup", i, argv[i]);
+            if (bind_layer(argv[i], workdir))
                 continue;
-            }
-            verbose_log("setup failed\n", "magic_mount");
+            error_log("setup failed\n", "magic_mount");
             reason = std::strerror(errno);
             goto failed;
         }
-        verbose_log("magic mount layerdir[0]=[%s]\n", "setup", real_dir);
+        info_log("magic mount layerdir[0]=[%s]\n", "setup", real_dir);
         if (mount(mnt_name, "0", "tmpfs", 0, nullptr)) {
             reason = std::strerror(errno);
             goto failed;
         }
-        for (int i=1; i < argc-1; i++) {
-            if (magic_mount(std::to_string(i).data(), "0", i)) {
-                continue;
-            }
-            verbose_log("mount failed\n", "magic_mount");
+        layer_fds.assign(argc - 1, -1);
+        for (int i=0; i < argc-1; i++)
+            layer_fds[i] = open(std::to_string(i).data(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (!magic_mount_layers(mnt_name, reason)) {
+            error_log("mount failed\n", "magic_mount");
             goto failed;
         }
     }
 
-    // remount to read-only
-    mount(nullptr, "0", nullptr, MS_REMOUNT | MS_RDONLY | MS_REC | mount_flags, nullptr);
-    // make mount as private so we can move mounts
-    mount(nullptr, "0", nullptr, MS_PRIVATE | MS_REC, nullptr);
-    if (mount("0", real_dir, nullptr, MS_MOVE, nullptr) == -1 &&
-        // recursive bind mount if moving mount does not work
-        mount("0", real_dir, nullptr, MS_BIND | MS_REC, nullptr) == -1) {
+    if (!attach_tree("0", real_dir)) {
         reason = std::strerror(errno);
         goto failed;
     }
-    verbose_log("mounted to %s\n", "magic_mount", real_dir);
+    // a folder bound on the root was moved alone, the tmpfs stays behind
+    record_tree(real_dir, -1, false);
+    info_log("mounted to %s\n", "magic_mount", real_dir);
+    if (!attach_namespaces(real_dir, reason))
+        goto failed;
 
     success:
-    fd_umount2(tmp_fd, MNT_DETACH);
-    close(tmp_fd);
+    stats_phase(PHASE_CLEANUP);
+    if (tmp_fd >= 0) {
+        fd_umount2(tmp_fd, MNT_DETACH);
+        close(tmp_fd);
+    }
+    if (stats_file && !write_stats(stats_file, mode, true))
+        error_log("unable to write stats=[%s]\n", "error", stats_file);
+    log_flush();
     return 0;
     
     failed:
     fprintf(stderr, "mount: '%s'->'%s': %s\n", mnt_name, real_dir, reason);
-    fd_umount2(tmp_fd, MNT_DETACH);
-    close(tmp_fd);
-    rmdir(tmp.data());
+    stats_phase(PHASE_CLEANUP);
+    if (tmp_fd >= 0) {
+        fd_umount2(tmp_fd, MNT_DETACH);
+        close(tmp_fd);
+        rmdir(tmp.data());
+    }
+    if (stats_file)
+        write_stats(stats_file, mode, false);
+    log_flush();
     return 1;
 }
@@ -0,0 +1,174 @@
+#include "mount_api.hpp"
+#include "utils.hpp"
+
+int sys_open_tree(int dfd, const char *path, unsigned flags) {
+    return syscall(__NR_open_tree, dfd, path, flags);
+}
+
+int sys_move_mount(int from_dfd, const char *from_path, int to_dfd, const char *to_path, unsigned flags) {
+    return syscall(__NR_move_mount, from_dfd, from_path, to_dfd, to_path, flags);
+}
+
+int sys_fsopen(const char *fs_name, unsigned flags) {
+    return syscall(__NR_fsopen, fs_name, flags);
+}
+
+int sys_fsconfig(int fd, unsigned cmd, const char *key, const void *value, int aux) {
+    return syscall(__NR_fsconfig, fd, cmd, key, value, aux);
+}
+
+int sys_fsmount(int fd, unsigned flags, unsigned attr_flags) {
+    return syscall(__NR_fsmount, fd, flags, attr_flags);
+}
+
+int sys_mount_setattr(int dfd, const char *path, unsigned flags, struct mount_attr *attr, size_t size) {
+    return syscall(__NR_mount_setattr, dfd, path, flags, attr, size);
+}
+
+int sys_statmount(const struct mnt_id_req *req, struct statmount *buf, size_t size, unsigned flags) {
+    return syscall(__NR_statmount, req, buf, size, flags);
+}
+
+int fsmount_tmpfs(const char *source) {
+    unique_fd fs(sys_fsopen("tmpfs", FSOPEN_CLOEXEC));
+    if (fs < 0 ||
+        sys_fsconfig(fs, FSCONFIG_SET_STRING, "source", source, 0) ||
+        sys_fsconfig(fs, FSCONFIG_CMD_CREATE, nullptr, nullptr, 0))
+        return -1;
+    return sys_fsmount(fs, FSMOUNT_CLOEXEC, 0);
+}
+
+// longest string value fsconfig(2) accepts, with its NUL
+#define FSCONFIG_VALUE_MAX 256
+
+int fsmount_overlay(const char *source, const std::vector<std::string> &lowers) {
+    // fsconfig takes string values below 256 bytes only, a lowerdir= of
+    // all layers fits a few short paths at most
+    std::string all;
+    for (auto &dir : lowers) {
+        if (dir.size() >= FSCONFIG_VALUE_MAX) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        all += (all.empty()? "" : ":") + dir;
+    }
+    unique_fd fs(sys_fsopen("overlay", FSOPEN_CLOEXEC));
+    if (fs < 0 || sys_fsconfig(fs, FSCONFIG_SET_STRING, "source", source, 0))
+        return -1;
+    // one lowerdir+ per layer (Linux 6.8+)
+    size_t added = 0;
+    while (added < lowers.size() &&
+           sys_fsconfig(fs, FSCONFIG_SET_STRING, "lowerdir+", lowers[added].data(), 0) == 0)
+        added++;
+    if (added == 0) {
+        if (all.size() >= FSCONFIG_VALUE_MAX) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if (sys_fsconfig(fs, FSCONFIG_SET_STRING, "lowerdir", all.data(), 0))
+            return -1;
+    } else if (added < lowers.size()) {
+        return -1;
+    }
+    if (sys_fsconfig(fs, FSCONFIG_CMD_CREATE, nullptr, nullptr, 0))
+        return -1;
+    return sys_fsmount(fs, FSMOUNT_CLOEXEC, MOUNT_ATTR_RDONLY);
+}
+
+bool can_mount_detached() {
+    // try attaching a tmpfs onto itself while it is still detached
+    unique_fd mnt(fsmount_tmpfs("probe"));
+    if (mnt < 0 || mkdirat(mnt, "probe", 0700))
+        return false;
+    unique_fd dir(openat(mnt, "probe", O_PATH | O_DIRECTORY | O_CLOEXEC));
+    return dir >= 0 && clone_mount(mnt, dir, false) == 0;
+}
+
+int clone_mount(int src_fd, int dest_fd, bool recursive) {
+    return clone_mount_at(src_fd, "", dest_fd, "", recursive);
+}
+
+int clone_mount_at(int src_dirfd, const char *src, int dest_dirfd, const char *dest, bool recursive) {
+    unique_fd tree(sys_open_tree(src_dirfd, src, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_SYMLINK_NOFOLLOW |
+                                 (src[0] ? 0 : AT_EMPTY_PATH) | (recursive ? AT_RECURSIVE : 0)));
+    if (tree < 0)
+        return -1;
+    return sys_move_mount(tree, "", dest_dirfd, dest,
+                          MOVE_MOUNT_F_EMPTY_PATH | (dest[0] ? 0 : MOVE_MOUNT_T_EMPTY_PATH));
+}
+
+int mount_setattr_flags(int fd, unsigned long flags, unsigned long propagation) {
+    struct mount_attr attr{};
+    if (flags & MS_RDONLY)
+        attr.attr_set |= MOUNT_ATTR_RDONLY;
+    if (flags & MS_NOSUID)
+        attr.attr_set |= MOUNT_ATTR_NOSUID;
+    if (flags & MS_NODEV)
+        attr.attr_set |= MOUNT_ATTR_NODEV;
+    if (flags & MS_NOEXEC)
+        attr.attr_set |= MOUNT_ATTR_NOEXEC;
+    if (flags & MS_NODIRATIME)
+        attr.attr_set |= MOUNT_ATTR_NODIRATIME;
+    if (flags & MS_NOSYMFOLLOW)
+        attr.attr_set |= MOUNT_ATTR_NOSYMFOLLOW;
+    if (flags & (MS_NOATIME | MS_RELATIME | MS_STRICTATIME)) {
+        // atime modes are exclusive, the kernel wants the whole mask cleared
+        attr.attr_clr |= MOUNT_ATTR__ATIME;
+        if (flags & MS_NOATIME)
+            attr.attr_set |= MOUNT_ATTR_NOATIME;
+        else if (flags & MS_STRICTATIME)
+            attr.attr_set |= MOUNT_ATTR_STRICTATIME;
+        else
+            attr.attr_set |= MOUNT_ATTR_RELATIME;
+    }
+    attr.propagation = propagation;
+    return sys_mount_setattr(fd, "", AT_EMPTY_PATH | AT_RECURSIVE, &attr, sizeof(attr));
+}
+
+int get_mount_id(int dirfd, const char *path, uint64_t *id, bool *unique) {
+    struct statx stx;
+    if (statx(dirfd, path, AT_SYMLINK_NOFOLLOW | (path[0]? 0 : AT_EMPTY_PATH),
+              STATX_MNT_ID | STATX_MNT_ID_UNIQUE, &stx))
+        return -1;
+    if (!(stx.stx_mask & (STATX_MNT_ID | STATX_MNT_ID_UNIQUE))) {
+        errno = ENOSYS;
+        return -1;
+    }
+    // stx_mnt_id follows stx_dev_minor, libcs without the field keep it as padding
+    memcpy(id, (const char *) &stx.stx_dev_minor + sizeof(stx.stx_dev_minor), sizeof(*id));
+    *unique = stx.stx_mask & STATX_MNT_ID_UNIQUE;
+    return 0;
+}
+
+int get_mount_point(uint64_t id, std::string &path) {
+    struct mnt_id_req req{};
+    req.size = MNT_ID_REQ_SIZE_VER0;
+    req.mnt_id = id;
+    req.param = STATMOUNT_MNT_POINT;
+    std::vector<char> buf(sizeof(struct statmount) + PATH_MAX);
+    auto sm = (struct statmount *) buf.data();
+    if (sys_statmount(&req, sm, buf.size(), 0))
+        return -1;
+    if (!(sm->mask & STATMOUNT_MNT_POINT)) {
+        errno = ENOSYS;
+        return -1;
+    }
+    path = sm->str + sm->mnt_point;
+    return 0;
+}
+
+int open_mnt_ns(const char *target) {
+    char *end;
+    long pid = strtol(target, &end, 10);
+    if (end == target || *end != '\0')
+        return open(target, O_RDONLY | O_CLOEXEC);
+    // no pid is taken without the check, the caller can pass the namespace file
+    unique_fd pidfd(syscall(__NR_pidfd_open, pid, 0));
+    if (pidfd < 0)
+        return -1;
+    unique_fd ns(open(("/proc/" + std::to_string(pid) + "/ns/mnt").data(), O_RDONLY | O_CLOEXEC));
+    // still the same process
+    if (ns >= 0 && syscall(__NR_pidfd_send_signal, (int) pidfd, 0, nullptr, 0))
+        return -1;
+    return ns.release();
+}
@@ -0,0 +1,166 @@
+#pragma once
+#include "base.hpp"
+
+// new mount api (Linux 5.2+), not every libc ships wrappers for it
+
+#ifndef __NR_open_tree
+#define __NR_open_tree 428
+#endif
+#ifndef __NR_move_mount
+#define __NR_move_mount 429
+#endif
+#ifndef __NR_fsopen
+#define __NR_fsopen 430
+#endif
+#ifndef __NR_fsconfig
+#define __NR_fsconfig 431
+#endif
+#ifndef __NR_fsmount
+#define __NR_fsmount 432
+#endif
+#ifndef __NR_mount_setattr
+#define __NR_mount_setattr 442
+#endif
+
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef MOVE_MOUNT_T_EMPTY_PATH
+#define MOVE_MOUNT_T_EMPTY_PATH 0x00000040
+#endif
+#ifndef FSOPEN_CLOEXEC
+#define FSOPEN_CLOEXEC 0x00000001
+#endif
+#ifndef FSMOUNT_CLOEXEC
+#define FSMOUNT_CLOEXEC 0x00000001
+#endif
+#ifndef FSCONFIG_SET_STRING
+#define FSCONFIG_SET_STRING 1
+#endif
+#ifndef FSCONFIG_CMD_CREATE
+#define FSCONFIG_CMD_CREATE 6
+#endif
+
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY 0x00000001
+#define MOUNT_ATTR_NOSUID 0x00000002
+#define MOUNT_ATTR_NODEV 0x00000004
+#define MOUNT_ATTR_NOEXEC 0x00000008
+#define MOUNT_ATTR__ATIME 0x00000070
+#define MOUNT_ATTR_RELATIME 0x00000000
+#define MOUNT_ATTR_NOATIME 0x00000010
+#define MOUNT_ATTR_STRICTATIME 0x00000020
+#define MOUNT_ATTR_NODIRATIME 0x00000080
+#endif
+#ifndef MOUNT_ATTR_NOSYMFOLLOW
+#define MOUNT_ATTR_NOSYMFOLLOW 0x00200000
+#endif
+
+#ifndef MOUNT_ATTR_SIZE_VER0
+struct mount_attr {
+    uint64_t attr_set;
+    uint64_t attr_clr;
+    uint64_t propagation;
+    uint64_t userns_fd;
+};
+#define MOUNT_ATTR_SIZE_VER0 32
+#endif
+
+// mount IDs (Linux 5.8+), the unique 64-bit ones and statmount (Linux 6.8+)
+
+#ifndef __NR_statmount
+#define __NR_statmount 457
+#endif
+#ifndef STATX_MNT_ID
+#define STATX_MNT_ID 0x00001000U
+#endif
+#ifndef STATX_MNT_ID_UNIQUE
+#define STATX_MNT_ID_UNIQUE 0x00004000U
+#endif
+
+#ifndef STATMOUNT_MNT_POINT
+struct mnt_id_req {
+    uint32_t size;
+    uint32_t spare;
+    uint64_t mnt_id;
+    uint64_t param;
+};
+#define MNT_ID_REQ_SIZE_VER0 24
+
+struct statmount {
+    uint32_t size;
+    uint32_t mnt_opts;
+    uint64_t mask;
+    uint32_t sb_dev_major;
+    uint32_t sb_dev_minor;
+    uint64_t sb_magic;
+    uint32_t sb_flags;
+    uint32_t fs_type;
+    uint64_t mnt_id;
+    uint64_t mnt_parent_id;
+    uint32_t mnt_id_old;
+    uint32_t mnt_parent_id_old;
+    uint64_t mnt_attr;
+    uint64_t mnt_propagation;
+    uint64_t mnt_peer_group;
+    uint64_t mnt_master;
+    uint64_t propagate_from;
+    uint32_t mnt_root;
+    uint32_t mnt_point;
+    uint64_t __spare2[50];
+    char str[];
+};
+#define STATMOUNT_MNT_POINT 0x00000010U
+#endif
+
+// process handles (Linux 5.3+)
+
+#ifndef __NR_pidfd_send_signal
+#define __NR_pidfd_send_signal 424
+#endif
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
+int sys_open_tree(int dfd, const char *path, unsigned flags);
+int sys_move_mount(int from_dfd, const char *from_path, int to_dfd, const char *to_path, unsigned flags);
+int sys_fsopen(const char *fs_name, unsigned flags);
+int sys_fsconfig(int fd, unsigned cmd, const char *key, const void *value, int aux);
+int sys_fsmount(int fd, unsigned flags, unsigned attr_flags);
+int sys_mount_setattr(int dfd, const char *path, unsigned flags, struct mount_attr *attr, size_t size);
+int sys_statmount(const struct mnt_id_req *req, struct statmount *buf, size_t size, unsigned flags);
+
+// check whether mounts can be attached to a detached tree (Linux 6.15+)
+bool can_mount_detached();
+// create a detached tmpfs named source, returns the mount fd
+int fsmount_tmpfs(const char *source);
+// create a detached read-only overlayfs named source of the folders lowers,
+// top first, returns the mount fd. Fails with ENAMETOOLONG without trying
+// where the paths do not fit fsconfig(2).
+int fsmount_overlay(const char *source, const std::vector<std::string> &lowers);
+// bind mount src_fd on top of dest_fd, dest_fd may live in a detached tree
+int clone_mount(int src_fd, int dest_fd, bool recursive);
+// bind mount src under src_dirfd on top of dest under dest_dirfd, without
+// following a symlink at either, "" for the dirfd itself
+int clone_mount_at(int src_dirfd, const char *src, int dest_dirfd, const char *dest, bool recursive);
+// apply MS_* flags and propagation to the whole tree under fd at once
+int mount_setattr_flags(int fd, unsigned long flags, unsigned long propagation);
+// ID of the mount on top of path under dirfd, or of dirfd itself if path is
+// "", the unique one if the kernel has it
+int get_mount_id(int dirfd, const char *path, uint64_t *id, bool *unique);
+// where the mount with unique ID id is mounted now, fails with ENOENT if it
+// is gone and ENOSYS without statmount
+int get_mount_point(uint64_t id, std::string &path);
+// open the mount namespace of target, a pid or a namespace file such as
+// /proc/PID/ns/mnt. A pid is held by a pidfd while its namespace is opened,
+// so a recycled pid is not mistaken for it. A pid fails without pidfd_open.
+int open_mnt_ns(const char *target);
@@ -0,0 +1,78 @@
+#pragma once
+#include "base.hpp"
+#include "utils.hpp"
+#include "arena.hpp"
+
+// results of the operations a parent batched ahead for one node,
+// do_mount runs whatever is missing itself
+struct mount_prep
+{
+    int created = 1;   // result of mkdirat or symlinkat, 1 if not run
+    unique_fd src;     // source of a file that may be inlined
+    unique_fd dest;    // placeholder file or created folder
+    bool bind = false; // set by do_mount, the node waits for its bind mount
+};
+
+// one entry of the merged tree, allocated in the arena. Only the name of the
+// entry is kept, interned, the path is rebuilt from the parents when needed.
+struct item_node
+{
+    item_node *parent = nullptr;
+    const char *base = "";     // interned name, "" for the root
+    const char *con = nullptr; // interned SELinux context
+    arena_span<item_node *> children;
+    arena_span<uint16_t> layers; // layers merged into this folder, in order
+    // the fields of struct stat the tree needs
+    dev_t st_rdev = 0;
+    mode_t st_mode = 0;
+    uid_t st_uid = 0;
+    gid_t st_gid = 0;
+    uint16_t layer = 0;    // layer the node is created from, 0 if no layer provides it
+    bool opaque = false;   // trusted opaque
+    bool unmerged = false; // no lower layer has this folder
+    bool bind_dir = false; // folder is bound as a whole
+    int8_t overlay = 0;    // -O: 1 folder mounted as overlayfs, -1 overlayfs failed
+    uint64_t stamp = 0;    // -p: layer folders read by the scan, see plan_stamp()
+
+    const char *name() const
+    {
+        return parent? base : ".";
+    }
+
+    // relative to the layer root, "" for the root
+    std::string path() const
+    {
+        return parent? parent->path() + "/" + base : std::string();
+    }
+
+    void set_stat(const struct stat &st)
+    {
+        st_mode = st.st_mode;
+        st_uid = st.st_uid;
+        st_gid = st.st_gid;
+        st_rdev = st.st_rdev;
+    }
+
+    int get_mode() const
+    {
+        if (S_ISDIR(st_mode))
+            return 0;
+        if (S_ISREG(st_mode))
+            return 1;
+        if (S_ISFIFO(st_mode))
+            return 2;
+        if (S_ISLNK(st_mode))
+            return 3;
+        if (S_ISBLK(st_mode))
+            return 4;
+        if (S_ISCHR(st_mode) && st_rdev > 0)
+            return 5;
+        return -1;
+    }
+
+    // create the entry under dest_dirfd from the same name under src_dirfd,
+    // a created folder is left open in prep.dest, parent_con is the context of dest_dirfd.
+    // Files and folders bound as a whole only get their placeholder, the
+    // caller binds them later.
+    bool do_mount(int src_dirfd, int dest_dirfd, const char *parent_con, mount_prep &prep);
+};
@@ -0,0 +1,222 @@
+#include <sys/uio.h>
+
+#include "plan.hpp"
+#include "utils.hpp"
+
+uint64_t plan_key(const std::vector<int> &layer_fds, char **argv, int options) {
+    uint64_t h = fnv1a(&options, sizeof(options));
+    for (size_t i = 1; i < layer_fds.size(); i++) {
+        struct stat st;
+        if (fstat(layer_fds[i], &st))
+            return 0;
+        uint64_t v[] = {
+            (uint64_t) st.st_dev, (uint64_t) st.st_ino,
+            (uint64_t) st.st_mtim.tv_sec, (uint64_t) st.st_mtim.tv_nsec,
+            (uint64_t) st.st_ctim.tv_sec, (uint64_t) st.st_ctim.tv_nsec,
+        };
+        h = fnv1a(v, sizeof(v), h);
+        h = fnv1a(argv[i], strlen(argv[i]) + 1, h);
+    }
+    return h;
+}
+
+uint64_t plan_stamp(int layer, const struct stat &st) {
+    uint64_t v[] = {
+        (uint64_t) layer, (uint64_t) st.st_dev, (uint64_t) st.st_ino,
+        (uint64_t) st.st_mtim.tv_sec, (uint64_t) st.st_mtim.tv_nsec,
+        (uint64_t) st.st_ctim.tv_sec, (uint64_t) st.st_ctim.tv_nsec,
+    };
+    return fnv1a(v, sizeof(v));
+}
+
+// stamp node again from its folders in layers, the layers holding it as a
+// folder are the ones its children are looked up in
+static bool check_node(const item_node &node, const std::vector<int> &layer_fds,
+                       const std::vector<uint16_t> &layers) {
+    if (node.stamp == 0)
+        return true;
+    std::string path = node.path();
+    const char *rel = path.empty()? "." : path.data() + 1;
+    std::vector<uint16_t> sub;
+    uint64_t stamp = 0;
+    for (uint16_t layer : layers) {
+        struct stat st;
+        if (fstatat(layer_fds[layer], rel, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) {
+            stamp += plan_stamp(layer, st);
+            sub.push_back(layer);
+        }
+    }
+    if (stamp != node.stamp)
+        return false;
+    for (auto *child : node.children)
+        if (S_ISDIR(child->st_mode) && !check_node(*child, layer_fds, sub))
+            return false;
+    return true;
+}
+
+bool check_plan(const item_node &root, const std::vector<int> &layer_fds) {
+    std::vector<uint16_t> layers;
+    for (size_t i = 1; i < layer_fds.size(); i++)
+        layers.push_back(i);
+    return check_node(root, layer_fds, layers);
+}
+
+struct plan_writer {
+    std::vector<plan_node> nodes;
+    std::vector<uint16_t> lists;
+    std::string names;
+    // a module tree repeats few names, store each one once
+    std::unordered_map<std::string, uint32_t> name_index;
+
+    uint32_t add_name(const char *name) {
+        auto it = name_index.emplace(name, names.size());
+        if (it.second)
+            names.append(name, strlen(name) + 1);
+        return it.first->second;
+    }
+
+    void add(const item_node &node) {
+        plan_node n{};
+        n.name = add_name(node.base);
+        n.children = node.children.size();
+        n.list = lists.size();
+        n.list_len = node.layers.size();
+        n.layer = node.layer;
+        n.mode = node.st_mode;
+        n.uid = node.st_uid;
+        n.gid = node.st_gid;
+        n.con = node.con? add_name(node.con) : PLAN_NO_CON;
+        n.rdev = node.st_rdev;
+        n.stamp = node.stamp;
+        n.flags = (node.opaque? PLAN_OPAQUE : 0) |
+                  (node.unmerged? PLAN_UNMERGED : 0) |
+                  (node.bind_dir? PLAN_BIND_DIR : 0);
+        for (int layer : node.layers)
+            lists.push_back(layer);
+        nodes.push_back(n);
+        for (auto *child : node.children)
+            add(*child);
+    }
+};
+
+bool save_plan(const char *file, const item_node &root, int layer_count, uint64_t key) {
+    plan_writer w;
+    w.add(root);
+
+    plan_header h{};
+    memcpy(h.magic, PLAN_MAGIC, sizeof(h.magic));
+    h.version = PLAN_VERSION;
+    h.layer_count = layer_count;
+    h.key = key;
+    h.node_count = w.nodes.size();
+    h.list_count = w.lists.size();
+    h.names_size = w.names.size();
+    h.checksum = fnv1a(w.nodes.data(), w.nodes.size() * sizeof(plan_node));
+    h.checksum = fnv1a(w.lists.data(), w.lists.size() * sizeof(uint16_t), h.checksum);
+    h.checksum = fnv1a(w.names.data(), w.names.size(), h.checksum);
+
+    struct iovec iov[] = {
+        { &h, sizeof(h) },
+        { w.nodes.data(), w.nodes.size() * sizeof(plan_node) },
+        { w.lists.data(), w.lists.size() * sizeof(uint16_t) },
+        { (void *) w.names.data(), w.names.size() },
+    };
+    size_t total = 0;
+    for (auto &v : iov)
+        total += v.iov_len;
+
+    std::string tmp = std::string(file) + ".tmp";
+    unique_fd fd(open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    if (fd < 0)
+        return false;
+    if (writev(fd, iov, sizeof(iov) / sizeof(iov[0])) != (ssize_t) total || fsync(fd) ||
+        rename(tmp.data(), file)) {
+        unlink(tmp.data());
+        return false;
+    }
+    return true;
+}
+
+struct plan_reader {
+    const plan_node *nodes;
+    const uint16_t *lists;
+    const char *names;
+    const plan_header *h;
+    uint32_t next = 0;
+
+    bool read(item_node &node, int layer_count) {
+        if (next >= h->node_count)
+            return false;
+        const plan_node &n = nodes[next++];
+        if (n.name >= h->names_size || n.layer == 0 || n.layer >= layer_count ||
+            (uint64_t) n.list + n.list_len > h->list_count)
+            return false;
+        const char *name = names + n.name;
+        if (memchr(name, '\0', h->names_size - n.name) == nullptr)
+            return false;
+        node.base = intern_name(name);
+        node.layer = n.layer;
+        node.st_mode = n.mode;
+        node.st_uid = n.uid;
+        node.st_gid = n.gid;
+        node.st_rdev = n.rdev;
+        node.stamp = n.stamp;
+        if (n.con != PLAN_NO_CON) {
+            if (n.con >= h->names_size || memchr(names + n.con, '\0', h->names_size - n.con) == nullptr)
+                return false;
+            node.con = intern_con(names + n.con);
+        }
+        node.opaque = n.flags & PLAN_OPAQUE;
+        node.unmerged = n.flags & PLAN_UNMERGED;
+        node.bind_dir = n.flags & PLAN_BIND_DIR;
+        for (uint32_t i = 0; i < n.list_len; i++) {
+            uint16_t layer = lists[n.list + i];
+            if (layer == 0 || layer >= layer_count)
+                return false;
+        }
+        node.layers = arena_copy(lists + n.list, n.list_len);
+        if (n.children > h->node_count - next)
+            return false;
+        std::vector<item_node *> children(n.children);
+        for (auto &child : children) {
+            child = arena_new<item_node>();
+            child->parent = &node;
+            if (!read(*child, layer_count))
+                return false;
+        }
+        node.children = arena_copy(children.data(), children.size());
+        return true;
+    }
+};
+
+bool load_plan(const char *file, item_node &root, int layer_count, uint64_t key, bool check_key) {
+    unique_fd fd(open(file, O_RDONLY | O_CLOEXEC));
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || (size_t) st.st_size < sizeof(plan_header))
+        return false;
+    size_t size = st.st_size;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+    auto h = (const plan_header *) map;
+    bool ret = false;
+    size_t body = (uint64_t) h->node_count * sizeof(plan_node) +
+                  (uint64_t) h->list_count * sizeof(uint16_t) + h->names_size;
+    if (memcmp(h->magic, PLAN_MAGIC, sizeof(h->magic)) == 0 &&
+        h->version == PLAN_VERSION && h->layer_count == (uint32_t) layer_count &&
+        (h->key == key || !check_key) && h->node_count > 0 && sizeof(*h) + body == size &&
+        fnv1a((const char *) map + sizeof(*h), body) == h->checksum) {
+        plan_reader r;
+        r.h = h;
+        r.nodes = (const plan_node *) (h + 1);
+        r.lists = (const uint16_t *) (r.nodes + h->node_count);
+        r.names = (const char *) (r.lists + h->list_count);
+        ret = r.read(root, layer_count) && r.next == h->node_count;
+    }
+    munmap(map, size);
+    if (!ret) {
+        // leave nothing half read behind
+        root = item_node();
+    }
+    return ret;
+}
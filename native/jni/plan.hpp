@@ -0,0 +1,69 @@
+#pragma once
+#include "node.hpp"
+
+// A plan is the merged tree saved by a previous run. File layout, all
+// integers in host byte order:
+//
+//   plan_header
+//   plan_node[node_count]      preorder, children follow their parent
+//   uint16_t[list_count]       layers merged into each folder
+//   char[names_size]           NUL terminated names and SELinux contexts
+//
+// The key covers the layer list, the options and the root inode, mtime and
+// ctime of every layer, so adding or removing an entry directly under a layer
+// root invalidates the plan. Every folder the scan read keeps the stamp of
+// its layer folders as well, check_plan() compares them all before a replay,
+// so entries added or removed deeper invalidate it too.
+
+#define PLAN_MAGIC "MMPLAN\0"
+#define PLAN_VERSION 4
+
+enum {
+    PLAN_OPAQUE = 1 << 0,
+    PLAN_UNMERGED = 1 << 1,
+    PLAN_BIND_DIR = 1 << 2,
+};
+
+#define PLAN_NO_CON UINT32_MAX
+
+struct plan_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t layer_count;
+    uint64_t key;
+    uint64_t checksum; // of everything after the header
+    uint32_t node_count;
+    uint32_t list_count;
+    uint32_t names_size;
+    uint32_t reserved;
+};
+
+struct plan_node {
+    uint32_t name;     // offset in names
+    uint32_t children; // number of direct children
+    uint32_t list;     // offset of merged layers in the layer lists
+    uint16_t list_len;
+    uint16_t layer;    // layer the node is created from
+    uint32_t mode;
+    uint32_t flags;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t con;      // offset of the context in names, PLAN_NO_CON if none
+    uint32_t reserved;
+    uint64_t rdev;
+    uint64_t stamp;    // 0 for entries the scan did not read
+};
+
+// validation key for the layers in layer_fds[1..] merged with options
+uint64_t plan_key(const std::vector<int> &layer_fds, char **argv, int options);
+// part of the stamp of a folder for its folder st in layer, the parts of all
+// its layers are added up
+uint64_t plan_stamp(int layer, const struct stat &st);
+// whether the layer folders in layer_fds[1..] still match every stamp of the
+// merged tree root loaded from a plan
+bool check_plan(const item_node &root, const std::vector<int> &layer_fds);
+// write the merged tree to file, the old plan is replaced atomically
+bool save_plan(const char *file, const item_node &root, int layer_count, uint64_t key);
+// rebuild the merged tree from file, false if it is missing, corrupt or stale,
+// without check_key a stale plan is read as well
+bool load_plan(const char *file, item_node &root, int layer_count, uint64_t key, bool check_key = true);
@@ -0,0 +1,197 @@
+#include <sys/uio.h>
+
+#include "provenance.hpp"
+
+static const char *kind_names[] = { "dir", "file", "symlink", "device", "whiteout", "bind_dir", "overlay" };
+
+struct index_writer {
+    std::vector<std::pair<std::string, index_entry>> entries;
+
+    void add(const item_node &node, const std::string &path) {
+        index_entry e{};
+        e.layer = node.layer;
+        e.flags = (node.opaque? INDEX_OPAQUE : 0) | (node.unmerged? INDEX_UNMERGED : 0);
+        bool leaf = true;
+        switch (node.get_mode()) {
+        case 0:
+            if (node.overlay > 0) {
+                e.kind = INDEX_OVERLAY;
+            } else if (node.bind_dir) {
+                e.kind = INDEX_BIND_DIR;
+            } else {
+                e.kind = INDEX_DIR;
+                leaf = false;
+            }
+            break;
+        case 1:
+        case 2:
+            e.kind = INDEX_FILE;
+            break;
+        case 3:
+            e.kind = INDEX_SYMLINK;
+            break;
+        case 4:
+        case 5:
+            e.kind = INDEX_DEVICE;
+            break;
+        default:
+            e.kind = INDEX_WHITEOUT;
+            break;
+        }
+        entries.emplace_back(path, e);
+        if (leaf)
+            return;
+        for (auto *child : node.children)
+            add(*child, path + "/" + child->base);
+    }
+};
+
+bool save_index(const char *file, const item_node &root, const std::vector<std::string> &layers) {
+    index_writer w;
+    w.add(root, "");
+    std::sort(w.entries.begin(), w.entries.end(),
+              [](const auto &a, const auto &b) { return a.first < b.first; });
+
+    std::string names;
+    std::vector<uint32_t> layer_names;
+    for (auto &l : layers) {
+        layer_names.push_back(names.size());
+        names.append(l.data(), l.size() + 1);
+    }
+    std::vector<index_entry> entries;
+    for (auto &[path, e] : w.entries) {
+        e.path = names.size();
+        names.append(path.data(), path.size() + 1);
+        entries.push_back(e);
+    }
+
+    index_header h{};
+    memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+    h.version = INDEX_VERSION;
+    h.layer_count = layer_names.size();
+    h.entry_count = entries.size();
+    h.names_size = names.size();
+
+    struct iovec iov[] = {
+        { &h, sizeof(h) },
+        { layer_names.data(), layer_names.size() * sizeof(uint32_t) },
+        { entries.data(), entries.size() * sizeof(index_entry) },
+        { (void *) names.data(), names.size() },
+    };
+    size_t total = 0;
+    for (auto &v : iov)
+        total += v.iov_len;
+
+    std::string tmp = std::string(file) + ".tmp";
+    unique_fd fd(open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (fd < 0)
+        return false;
+    if (writev(fd, iov, sizeof(iov) / sizeof(iov[0])) != (ssize_t) total || fsync(fd) ||
+        rename(tmp.data(), file)) {
+        unlink(tmp.data());
+        return false;
+    }
+    return true;
+}
+
+struct index_reader {
+    const index_header *h;
+    const uint32_t *layers;
+    const index_entry *entries;
+    const char *names;
+
+    // NUL terminated string at off, nullptr if it runs past the names
+    const char *str(uint32_t off) const {
+        if (off >= h->names_size || memchr(names + off, '\0', h->names_size - off) == nullptr)
+            return nullptr;
+        return names + off;
+    }
+
+    // binary search for path, nullptr if it is not listed
+    const index_entry *find(const std::string &path) const {
+        size_t lo = 0, hi = h->entry_count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            const char *p = str(entries[mid].path);
+            if (p == nullptr)
+                return nullptr;
+            int cmp = strcmp(p, path.data());
+            if (cmp == 0)
+                return &entries[mid];
+            if (cmp < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return nullptr;
+    }
+
+    // entry of path, or of the folder bound whole or merged by overlayfs
+    // above it, below which the mounted tree is checked for path
+    const index_entry *lookup(const std::string &path, const char *target) const {
+        std::string dir = path;
+        for (;;) {
+            auto e = find(dir);
+            if (e && dir.size() == path.size())
+                return e;
+            if (e && (e->kind == INDEX_BIND_DIR || e->kind == INDEX_OVERLAY))
+                return faccessat(AT_FDCWD, (target + path).data(), F_OK, AT_SYMLINK_NOFOLLOW)? nullptr : e;
+            size_t slash = dir.rfind('/');
+            if (e || slash == std::string::npos)
+                return nullptr;
+            dir.resize(slash);
+        }
+    }
+};
+
+int lookup_index(const char *file, char *const *paths, int count) {
+    unique_fd fd(open(file, O_RDONLY | O_CLOEXEC));
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || (size_t) st.st_size < sizeof(index_header))
+        return -1;
+    size_t size = st.st_size;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    index_reader r;
+    r.h = (const index_header *) map;
+    r.layers = (const uint32_t *) (r.h + 1);
+    r.entries = (const index_entry *) (r.layers + r.h->layer_count);
+    r.names = (const char *) (r.entries + r.h->entry_count);
+    const char *target;
+    if (memcmp(r.h->magic, INDEX_MAGIC, sizeof(r.h->magic)) || r.h->version != INDEX_VERSION ||
+        r.h->layer_count == 0 ||
+        sizeof(index_header) + (uint64_t) r.h->layer_count * sizeof(uint32_t) +
+        (uint64_t) r.h->entry_count * sizeof(index_entry) + r.h->names_size != size ||
+        (target = r.str(r.layers[0])) == nullptr) {
+        munmap(map, size);
+        errno = EINVAL;
+        return -1;
+    }
+    size_t target_len = strlen(target);
+    int missing = 0;
+    for (int i = 0; i < count; i++) {
+        // under the target, or relative to it
+        std::string path = paths[i];
+        if (path.compare(0, target_len, target) == 0 &&
+            (path.size() == target_len || path[target_len] == '/'))
+            path.erase(0, target_len);
+        else if (path[0] != '/')
+            path.insert(0, "/");
+        while (!path.empty() && path.back() == '/')
+            path.pop_back();
+        auto e = r.lookup(path, target);
+        const char *layer = nullptr;
+        if (e == nullptr || e->kind >= sizeof(kind_names) / sizeof(kind_names[0]) ||
+            e->layer >= r.h->layer_count || (layer = r.str(r.layers[e->layer])) == nullptr) {
+            printf("%s -\n", paths[i]);
+            missing++;
+            continue;
+        }
+        printf("%s %s%s%s %d %s%s\n", paths[i], kind_names[e->kind],
+               (e->flags & INDEX_OPAQUE)? ",opaque" : "", (e->flags & INDEX_UNMERGED)? ",unmerged" : "",
+               e->layer, e->layer? layer : "-", e->layer? path.data() : "");
+    }
+    munmap(map, size);
+    return missing;
+}
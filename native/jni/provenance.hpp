@@ -0,0 +1,56 @@
+#pragma once
+#include "node.hpp"
+
+// A provenance index tells which layer serves each path of a mounted tree.
+// File layout, all integers in host byte order, mmap-able as is:
+//
+//   index_header
+//   uint32_t[layer_count]      offset of each layer folder in names, 0 is the target
+//   index_entry[entry_count]   sorted by path
+//   char[names_size]           NUL terminated paths and layer folders
+//
+// Paths are relative to the target and start with "/", the root is "". The
+// entries below a folder bound whole or merged by overlayfs are not listed,
+// a lookup finds them through that folder.
+
+#define INDEX_MAGIC "MMINDEX"
+#define INDEX_VERSION 1
+
+enum {
+    INDEX_DIR,      // folder created in the tmpfs
+    INDEX_FILE,     // file or FIFO bound, or copied with -i
+    INDEX_SYMLINK,
+    INDEX_DEVICE,
+    INDEX_WHITEOUT, // hidden by a whiteout of the layer
+    INDEX_BIND_DIR, // folder bound whole, everything below comes from the layer
+    INDEX_OVERLAY,  // folder merged by overlayfs
+};
+
+enum {
+    INDEX_OPAQUE = 1 << 0,
+    INDEX_UNMERGED = 1 << 1,
+};
+
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t layer_count;
+    uint32_t entry_count;
+    uint32_t names_size;
+};
+
+struct index_entry {
+    uint32_t path;  // offset in names
+    uint16_t layer; // 0 if no single layer serves it, as for a whole overlayfs
+    uint8_t kind;
+    uint8_t flags;
+};
+
+// write the provenance of the tree root, mounted from the folders layers (0
+// is the target), to file, the old index is replaced atomically
+bool save_index(const char *file, const item_node &root, const std::vector<std::string> &layers);
+// print the entry serving each of paths, given under the target or relative
+// to it: PATH KIND[,FLAG...] LAYER SOURCE. Paths not in the tree print "-",
+// below a folder bound whole or merged by overlayfs the mounted target tells.
+// Returns the number of them, -1 if file is not a valid index.
+int lookup_index(const char *file, char *const *paths, int count);
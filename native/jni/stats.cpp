@@ -0,0 +1,55 @@
+#include "stats.hpp"
+#include <time.h>
+
+run_stats stats;
+
+static const char *phase_names[PHASE_COUNT] = {
+    "workdir", "bind_layers", "discovery", "materialize", "binds", "remount", "move", "cleanup",
+};
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static const uint64_t start_us = now_us();
+static uint64_t phase_us[PHASE_COUNT];
+static int current_phase = PHASE_NONE;
+static uint64_t phase_start;
+
+void stats_phase(int phase) {
+    uint64_t now = now_us();
+    if (current_phase != PHASE_NONE)
+        phase_us[current_phase] += now - phase_start;
+    current_phase = phase;
+    phase_start = now;
+}
+
+bool write_stats(const char *file, const char *mode, bool ok) {
+    stats_phase(PHASE_NONE);
+    std::string out = "{\"result\":\"";
+    out += ok? "ok" : "failed";
+    out += "\",\"mode\":\"";
+    out += mode;
+    out += "\",\"phases_us\":{";
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        out += "\"";
+        out += phase_names[i];
+        out += "\":" + std::to_string(phase_us[i]) + ",";
+    }
+    out += "\"total\":" + std::to_string(now_us() - start_us) + "},\"counters\":{";
+#define X(name) out += "\"" #name "\":" + std::to_string(stats.name.load()) + ",";
+    STATS_COUNTERS(X)
+#undef X
+    out.back() = '}';
+    out += "}\n";
+
+    int fd = (strcmp(file, "-") == 0)? dup(STDERR_FILENO) :
+        open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    bool ret = write(fd, out.data(), out.size()) == (ssize_t) out.size();
+    close(fd);
+    return ret;
+}
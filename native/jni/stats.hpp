@@ -0,0 +1,42 @@
+#pragma once
+#include "base.hpp"
+#include <atomic>
+
+// counters of one run, updated from every scanning thread
+#define STATS_COUNTERS(X) \
+    X(dirs) X(files) X(fifos) X(symlinks) X(block_devs) X(char_devs) X(whiteouts) \
+    X(opaque) X(unmerged) \
+    X(bind_mounts) X(overlay_mounts) X(mkdirs) X(symlink_creates) X(mknods) \
+    X(xattr_reads) X(xattr_writes) \
+    X(inlined_files) X(inlined_bytes) X(tmpfs_bytes) \
+    X(deduped) X(collapsed) \
+    X(syscalls) // issued for the tree, close(2) excluded, an io_uring submission counts once
+
+struct run_stats {
+#define X(name) std::atomic<uint64_t> name{0};
+    STATS_COUNTERS(X)
+#undef X
+};
+
+extern run_stats stats;
+
+#define STAT_ADD(name, n) stats.name.fetch_add(n, std::memory_order_relaxed)
+#define STAT_INC(name) STAT_ADD(name, 1)
+
+enum {
+    PHASE_NONE = -1,
+    PHASE_WORKDIR,     // tmpfs for the merged tree
+    PHASE_BIND_LAYERS, // layers bound into the workdir, or opened
+    PHASE_DISCOVERY,   // scan or plan replay
+    PHASE_MATERIALIZE, // skeleton of the merged tree in the tmpfs
+    PHASE_BINDS,       // bind mounts into the skeleton
+    PHASE_REMOUNT,     // read-only and private
+    PHASE_MOVE,        // attach to the target
+    PHASE_CLEANUP,     // workdir teardown
+    PHASE_COUNT,
+};
+
+// end the running phase and start phase, PHASE_NONE only ends it
+void stats_phase(int phase);
+// append the report as one JSON line to file, "-" for stderr
+bool write_stats(const char *file, const char *mode, bool ok);
@@ -0,0 +1,82 @@
+#include "thread_pool.hpp"
+
+static thread_local int worker_index = 0;
+
+thread_pool::thread_pool(int threads) {
+    if (threads < 1)
+        threads = 1;
+    for (int i = 0; i < threads; i++)
+        queues.emplace_back(new worker_queue);
+    for (int i = 1; i < threads; i++)
+        workers.emplace_back(&thread_pool::run_worker, this, i);
+}
+
+thread_pool::~thread_pool() {
+    {
+        std::lock_guard<std::mutex> lk(idle_lock);
+        stop = true;
+    }
+    idle_cv.notify_all();
+    for (auto &w : workers)
+        w.join();
+}
+
+void thread_pool::submit(task t) {
+    auto &q = *queues[worker_index];
+    pending++;
+    {
+        std::lock_guard<std::mutex> lk(q.lock);
+        q.tasks.push_back(std::move(t));
+    }
+    {
+        std::lock_guard<std::mutex> lk(idle_lock);
+        queued++;
+    }
+    idle_cv.notify_one();
+}
+
+bool thread_pool::next_task(int self, task &t) {
+    int n = queues.size();
+    for (int i = 0; i < n; i++) {
+        auto &q = *queues[(self + i) % n];
+        std::lock_guard<std::mutex> lk(q.lock);
+        if (q.tasks.empty())
+            continue;
+        if (i == 0) {
+            t = std::move(q.tasks.back());
+            q.tasks.pop_back();
+        } else {
+            t = std::move(q.tasks.front());
+            q.tasks.pop_front();
+        }
+        queued--;
+        return true;
+    }
+    return false;
+}
+
+void thread_pool::run_worker(int self) {
+    worker_index = self;
+    task t;
+    for (;;) {
+        if (next_task(self, t)) {
+            t();
+            t = nullptr;
+            if (--pending == 0) {
+                std::lock_guard<std::mutex> lk(idle_lock);
+                idle_cv.notify_all();
+            }
+            continue;
+        }
+        std::unique_lock<std::mutex> lk(idle_lock);
+        if (self == 0 && pending == 0)
+            return;
+        if (self != 0 && stop)
+            return;
+        idle_cv.wait(lk, [&] { return queued > 0 || stop || (self == 0 && pending == 0); });
+    }
+}
+
+void thread_pool::wait() {
+    run_worker(0);
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// work-stealing pool, every worker owns a deque and runs its newest task
+// first while idle workers steal the oldest tasks of the others
+class thread_pool {
+public:
+    using task = std::function<void()>;
+
+    // threads includes the caller of wait(), which works as worker 0
+    explicit thread_pool(int threads);
+    ~thread_pool();
+
+    // queue a task, tasks queued from a worker go to that worker's deque
+    void submit(task t);
+    // run tasks until everything queued, including tasks queued by tasks, is done
+    void wait();
+
+private:
+    struct worker_queue {
+        std::mutex lock;
+        std::deque<task> tasks;
+    };
+
+    bool next_task(int self, task &t);
+    void run_worker(int self);
+
+    std::vector<std::unique_ptr<worker_queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<long> pending{0};
+    std::atomic<long> queued{0};
+    std::atomic<bool> stop{false};
+    std::mutex idle_lock;
+    std::condition_variable idle_cv;
+};
@@ -1,4 +1,5 @@
 #include "base.hpp"
+#include "stats.hpp"
 
 std::string random_strc(int n){
     std::string result = "";
@@ -181,6 +182,14 @@ int getfilecon(const char *path, char **con) {
     return getxattr(path, "security.selinux", *con, sizeof(char)*255);
 }
 
+// a module tree uses a handful of contexts, keep a single copy of each
+const char *intern_con(const char *con) {
+    static std::mutex lock;
+    static std::unordered_set<std::string> pool;
+    std::lock_guard<std::mutex> lk(lock);
+    return pool.emplace(con).first->data();
+}
+
 int setfilecon(const char *path, const char *con) {
     return setxattr(path, "security.selinux", con, (strlen(con) + 1)*sizeof(char), 0);
 }
@@ -193,7 +202,93 @@ std::string fd_path(int fd) {
     return std::string("/proc/self/fd/") + std::to_string(fd);
 }
 
+// path of name under dirfd through /proc, for calls that have no *at() variant
+std::string at_path(int dirfd, const char *name) {
+    if (dirfd == AT_FDCWD || name[0] == '/')
+        return name;
+    if (name[0] == '\0')
+        return fd_path(dirfd);
+    return fd_path(dirfd) + "/" + name;
+}
+
+// stat that only asks the kernel for the STATX_* fields in mask, the type
+// is always filled, fields outside of mask are left untouched
+void statx_to_stat(const struct statx &stx, unsigned mask, struct stat *st) {
+    st->st_mode = stx.stx_mode;
+    if (mask & STATX_UID)
+        st->st_uid = stx.stx_uid;
+    if (mask & STATX_GID)
+        st->st_gid = stx.stx_gid;
+    if (mask & STATX_INO)
+        st->st_ino = stx.stx_ino;
+    if (mask & STATX_SIZE)
+        st->st_size = stx.stx_size;
+    st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    st->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+}
+
+int statx_mask(int dirfd, const char *name, int flags, unsigned mask, struct stat *st) {
+    // set once by whichever scanning thread sees ENOSYS first
+    static std::atomic<bool> no_statx{false};
+    STAT_INC(syscalls);
+    if (!no_statx.load(std::memory_order_relaxed)) {
+        struct statx stx;
+        if (statx(dirfd, name, flags, mask | STATX_TYPE, &stx) == 0) {
+            statx_to_stat(stx, mask, st);
+            return 0;
+        }
+        if (errno != ENOSYS)
+            return -1;
+        // kernel older than 4.11
+        no_statx.store(true, std::memory_order_relaxed);
+        STAT_INC(syscalls);
+    }
+    return fstatat(dirfd, name, st, flags);
+}
+
 int fd_umount2(int fd, int mode) {
     return umount2(fd_path(fd).data(), mode);
 }
 
+uint64_t fnv1a(const void *data, size_t len, uint64_t h) {
+    auto p = (const unsigned char *) data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+
+bool read_dents(int fd, std::vector<char> &buf) {
+    constexpr size_t chunk = 32768;
+    buf.clear();
+    for (;;) {
+        size_t off = buf.size();
+        buf.resize(off + chunk);
+        long n = syscall(__NR_getdents64, fd, buf.data() + off, chunk);
+        STAT_INC(syscalls);
+        if (n <= 0) {
+            buf.resize(off);
+            return n == 0;
+        }
+        buf.resize(off + n);
+    }
+}
+
+// interned context of name under dirfd, or of dirfd itself if name is empty,
+// *con is nullptr if the entry has no context or the fs has no xattrs
+int getcon_interned(int dirfd, const char *name, const char **con) {
+    char buf[256];
+    ssize_t len = (name[0] == '\0')?
+        fgetxattr(dirfd, "security.selinux", buf, sizeof(buf) - 1) :
+        lgetxattr(at_path(dirfd, name).data(), "security.selinux", buf, sizeof(buf) - 1);
+    STAT_INC(syscalls);
+    STAT_INC(xattr_reads);
+    *con = nullptr;
+    if (len < 0)
+        return (errno == ENODATA || errno == ENOTSUP)? 0 : -1;
+    buf[len] = '\0';
+    *con = intern_con(buf);
+    return 0;
+}
@@ -1,3 +1,4 @@
+#pragma once
 #include "base.hpp"
 
 std::string random_strc(int n);
@@ -19,8 +20,56 @@ const char *xgetenv(const char *name);
 bool str_empty(const char *str);
 std::vector<std::string> split_ro(const std::string& str, const char delimiter);
 int getfilecon(const char *path, char **con);
+int getcon_interned(int dirfd, const char *name, const char **con);
+const char *intern_con(const char *con);
 int setfilecon(const char *path, const char *con);
 void freecon(char *con);
 std::string fd_path(int fd);
+std::string at_path(int dirfd, const char *name);
+void statx_to_stat(const struct statx &stx, unsigned mask, struct stat *st);
+int statx_mask(int dirfd, const char *name, int flags, unsigned mask, struct stat *st);
 int fd_umount2(int fd, int mode);
+// 64-bit FNV-1a of data, continuing from h
+uint64_t fnv1a(const void *data, size_t len, uint64_t h = 0xcbf29ce484222325ULL);
+
+// close-on-destruction file descriptor
+struct unique_fd {
+    int fd;
+    explicit unique_fd(int fd = -1) : fd(fd) {}
+    ~unique_fd() { reset(); }
+    unique_fd(const unique_fd &) = delete;
+    unique_fd &operator=(const unique_fd &) = delete;
+    unique_fd(unique_fd &&o) : fd(o.release()) {}
+    unique_fd &operator=(unique_fd &&o) {
+        reset(o.release());
+        return *this;
+    }
+    void reset(int nfd = -1) {
+        if (fd >= 0) close(fd);
+        fd = nfd;
+    }
+    int release() {
+        int ret = fd;
+        fd = -1;
+        return ret;
+    }
+    operator int() const { return fd; }
+};
+
+// record layout returned by getdents64(2)
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// read all entries of directory fd in bulk, "." and ".." included
+bool read_dents(int fd, std::vector<char> &buf);
+
+#define for_each_dent(d, buf) \
+    for (auto *d = (struct linux_dirent64 *) (buf).data(); \
+         (char *) d < (buf).data() + (buf).size(); \
+         d = (struct linux_dirent64 *) ((char *) d + d->d_reclen))
 